@@ -0,0 +1,93 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+
+// Array on the heap whose first element starts at a multiple of ALIGNMENT bytes (a cache line),
+// so vector loads never cross cache lines when the element count per row is a multiple of it.
+// The buffer owns its memory: it can be moved, but not copied, which would only duplicate megabytes of weights.
+// A buffer created by view() instead refers to memory owned by someone else, like a read-only file mapping.
+template <typename T>
+class AlignedBuffer
+{
+	static_assert(std::is_trivial<T>::value, "Elements are never constructed or destroyed");
+
+public:
+	static const size_t ALIGNMENT = 64;
+
+private:
+	// Allocation as returned by operator new, the aligned data starts somewhere within the first ALIGNMENT bytes
+	void* memory;
+	T* elements;
+	size_t count;
+
+public:
+	AlignedBuffer() : memory(nullptr), elements(nullptr), count(0) {}
+
+	/// <summary>
+	/// Allocates an uninitialized buffer of the given number of elements.
+	/// </summary>
+	explicit AlignedBuffer(size_t size) : count(size) {
+		memory = ::operator new(size * sizeof(T) + ALIGNMENT);
+		elements = reinterpret_cast<T*>((reinterpret_cast<uintptr_t>(memory) + ALIGNMENT - 1) & ~(uintptr_t)(ALIGNMENT - 1));
+	}
+
+	/// <summary>
+	/// Refers to the given elements without owning them, they have to stay valid as long as the buffer is used.
+	/// The elements of a read-only mapping must not be written through the buffer.
+	/// </summary>
+	/// <param name="elements">starting at a multiple of ALIGNMENT bytes</param>
+	static AlignedBuffer view(const T* elements, size_t size) {
+		AlignedBuffer buffer;
+		buffer.elements = const_cast<T*>(elements);
+		buffer.count = size;
+		return buffer;
+	}
+
+	AlignedBuffer(AlignedBuffer&& other) noexcept : memory(other.memory), elements(other.elements), count(other.count) {
+		other.memory = nullptr;
+		other.elements = nullptr;
+		other.count = 0;
+	}
+
+	AlignedBuffer& operator=(AlignedBuffer&& other) noexcept {
+		if (this != &other) {
+			::operator delete(memory);
+			memory = other.memory;
+			elements = other.elements;
+			count = other.count;
+			other.memory = nullptr;
+			other.elements = nullptr;
+			other.count = 0;
+		}
+		return *this;
+	}
+
+	AlignedBuffer(const AlignedBuffer&) = delete;
+	AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+
+	~AlignedBuffer() {
+		::operator delete(memory);
+	}
+
+	T* data() {
+		return elements;
+	}
+
+	const T* data() const {
+		return elements;
+	}
+
+	size_t size() const {
+		return count;
+	}
+
+	T& operator[](size_t index) {
+		return elements[index];
+	}
+
+	const T& operator[](size_t index) const {
+		return elements[index];
+	}
+};
@@ -710,6 +710,27 @@ AttackData Bitboard::getAttackData(short attackedPlayer) {
     return data;
 }
 
+bitboard Bitboard::getAttackersTo(unsigned short square, bitboard occupied)
+{
+    bitboard target = bitboard(1) << square;
+    bitboard attackers = bitboard(0);
+
+    // Pawns attack the square from where an enemy pawn on it would attack
+    attackers |= (getPawnAttacks(target, true, Piece::BLACK) | getPawnAttacks(target, false, Piece::BLACK)) & allPieces[Piece::PAWN | Piece::WHITE];
+    attackers |= (getPawnAttacks(target, true, Piece::WHITE) | getPawnAttacks(target, false, Piece::WHITE)) & allPieces[Piece::PAWN | Piece::BLACK];
+
+    attackers |= getKnightAttacks(square) & (allPieces[Piece::KNIGHT | Piece::WHITE] | allPieces[Piece::KNIGHT | Piece::BLACK]);
+    attackers |= getKingAttacks(square) & (allPieces[Piece::KING | Piece::WHITE] | allPieces[Piece::KING | Piece::BLACK]);
+
+    bitboard queens = allPieces[Piece::QUEEN | Piece::WHITE] | allPieces[Piece::QUEEN | Piece::BLACK];
+    bitboard bishops = allPieces[Piece::BISHOP | Piece::WHITE] | allPieces[Piece::BISHOP | Piece::BLACK];
+    bitboard rooks = allPieces[Piece::ROOK | Piece::WHITE] | allPieces[Piece::ROOK | Piece::BLACK];
+    attackers |= getBishopAttacks(square, occupied) & (bishops | queens);
+    attackers |= getRookAttacks(square, occupied) & (rooks | queens);
+
+    return attackers & occupied;
+}
+
 bool Bitboard::containsSquare(bitboard b, unsigned short square)
 {
     return (b >> square) & 1;
@@ -119,6 +119,10 @@ public:
 	/// Returns an empty bitboard if there is no connecting ray.</returns>
 	bitboard getConnectingRay(unsigned short king, unsigned short attacker, short pieceType);
 	AttackData getAttackData(short pinnedPiecesColor);
+	/// <param name="square">that is attacked.</param>
+	/// <param name="occupied">squares that block sliding pieces, pieces not on these squares are ignored.</param>
+	/// <returns>a bitboard of all pieces of both colors that attack the square.</returns>
+	bitboard getAttackersTo(unsigned short square, bitboard occupied);
 	/// <returns>wether the given bitboard has the bit for the given square set to 1.</returns>
 	bool containsSquare(bitboard b, unsigned short square);
 	/// <returns>number of 1s set in the given bitboard.</returns>
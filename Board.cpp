@@ -2,6 +2,9 @@
 #include "Piece.h"
 #include <iostream>
 #include <string>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
 #include "Profiling.h"
 #include "Zobrist.h"
 #include "TranspositionTable.h"
@@ -17,15 +20,23 @@ const std::string Board::squareNames[] = {
 		"a8","b8","c8","d8","e8","f8","g8","h8"
 };
 
+const std::string Board::defaultNetworkPath = "C:\\Users\\simon\\Documents\\Hochschule\\Schachengine\\TrainedNets\\OneTraining\\net.nnue";
+
 Board::GameState Board::gameState = Board::GameState();
 Bitboard Board::bb = Bitboard();
 short Board::blackKingPos = 60;
 short Board::whiteKingPos = 4;
+int Board::reductions[Board::MAX_PLY][Board::MAX_REDUCTION_MOVES];
 
-Board::Board() : possibleMoves(), moveHistory(), futureMovesBuffer(), wantsToPromote(false),
-nnue("C:\\Users\\simon\\Documents\\Hochschule\\Schachengine\\TrainedNets\\OneTraining\\net.bin") {
+Board::Board() : nnue(defaultNetworkPath), timeOut(false), previousPositions(0), pvTable(MAX_PLY * MAX_PLY),
+processing(false), stopDemanded(false), multiPV(1), wantsToPromote(false), possibleMoves(), moveHistory(),
+accumulatorStack(2 * MAX_PLY), accumulatorIndex(0), refreshTable(64), futureMovesBuffer() {
 	Zobrist::initializeHashes();
+	if (NNUE_EVAL && !nnue.isLoaded())
+		std::cerr << "No network loaded, using the material evaluation.\n";
+	initRefreshTable();
 	TranspositionTable::setSize(128);
+	initReductions();
 }
 
 
@@ -40,7 +51,6 @@ void Board::reset() {
 	moveHistory = std::stack<Move>();
 	futureMovesBuffer = std::stack<Move>();
 	positionHistory = std::vector<unsigned long long>();
-	accumulatorHistory = std::stack<NNUE::Accumulator>();
 	gameState = GameState();
 	wantsToPromote = false;
 	TranspositionTable::clear();
@@ -357,19 +367,63 @@ std::string Board::getFENfromPos() {
 }
 
 void Board::initAccumulators() {
-	std::vector<int> activeFeaturesW, activeFeaturesB;
-	// Collect the feature vector halves for both perspectives
+	// The current position becomes the root of the accumulator stack
+	accumulatorIndex = 0;
+	AccumulatorEntry& entry = accumulatorStack[0];
+	for (int white = 0; white < 2; white++) {
+		refreshAccumulator(entry.accumulator, white);
+		entry.computed[white] = true;
+		entry.refresh[white] = false;
+	}
+}
+
+bool Board::loadNetwork(std::string path) {
+	if (!nnue.load(path))
+		return false;
+	// The refresh table and the accumulator stack hold accumulators of the old network, which may even have had another width
+	initRefreshTable();
+	initAccumulators();
+	return true;
+}
+
+void Board::initRefreshTable() {
+	for (RefreshEntry& entry : refreshTable) {
+		for (int white = 0; white < 2; white++) {
+			nnue.recalculateAccumulator(entry.accumulator, nullptr, 0, white);
+			for (bitboard& pieces : entry.pieces[white]) {
+				pieces = 0;
+			}
+		}
+	}
+}
+
+void Board::refreshAccumulator(NNUE::Accumulator& accumulator, bool white) {
+	const short perspective = white ? Piece::WHITE : Piece::BLACK;
+	const short kingSquare = white ? whiteKingPos : blackKingPos;
+	RefreshEntry& entry = refreshTable[kingSquare];
+
+	// Every piece that left or entered a square since the entry was stored, at most all the non-king pieces of both positions
+	int removedFeatures[NNUE::MAX_ACTIVE_FEATURES], addedFeatures[NNUE::MAX_ACTIVE_FEATURES];
+	int removedCount = 0, addedCount = 0;
+	bitboard* cachedPieces = entry.pieces[white];
 	for (short color = Piece::WHITE; color <= Piece::BLACK; color += Piece::WHITE) {
 		for (short type = Piece::PAWN; type <= Piece::QUEEN; type++) {
-			bitboard pieces = bb.getBitboard(color | type);
-			Bitloop(pieces) {
-				activeFeaturesW.push_back(nnue.getHalfKPindex(Piece::WHITE, type, color, getSquare(pieces), whiteKingPos));
-				activeFeaturesB.push_back(nnue.getHalfKPindex(Piece::BLACK, type, color, getSquare(pieces), blackKingPos));
+			bitboard& cached = *cachedPieces++;
+			const bitboard current = bb.getBitboard(color | type);
+			bitboard removed = cached & ~current;
+			bitboard added = current & ~cached;
+			Bitloop(removed) {
+				removedFeatures[removedCount++] = nnue.getHalfKPindex(perspective, type, color, getSquare(removed), kingSquare);
+			}
+			Bitloop(added) {
+				addedFeatures[addedCount++] = nnue.getHalfKPindex(perspective, type, color, getSquare(added), kingSquare);
 			}
+			cached = current;
 		}
 	}
-	nnue.recalculateAccumulator(activeFeaturesW, true);
-	nnue.recalculateAccumulator(activeFeaturesB, false);
+
+	nnue.updateAccumulator(entry.accumulator, entry.accumulator, removedFeatures, removedCount, addedFeatures, addedCount, white);
+	std::memcpy(accumulator[white], entry.accumulator[white], nnue.transformerSize() * sizeof(int16_t));
 }
 
 short Board::getPiece(unsigned short column, unsigned short row)
@@ -561,33 +615,83 @@ void Board::makeAiMove() {
 	checkForMateOrRemis();
 }
 
-void Board::saveAccumulators() {
-	// Create new accumulator array
-	NNUE::Accumulator acc;
-	// Copy contents of current accumulator
-	for (int i = 0; i < M; i++) {
-		acc[0][i] = nnue.accumulator[0][i];
-		acc[1][i] = nnue.accumulator[1][i];
+Board::AccumulatorEntry& Board::pushAccumulator() {
+	// Only long games exceed the preallocated entries
+	if (++accumulatorIndex == accumulatorStack.size()) {
+		accumulatorStack.resize(2 * accumulatorStack.size());
 	}
-	// Save to history
-	accumulatorHistory.push(acc);
+	AccumulatorEntry& entry = accumulatorStack[accumulatorIndex];
+	entry.computed[0] = entry.computed[1] = false;
+	entry.refresh[0] = entry.refresh[1] = false;
+	entry.dirtyPieces.count = 0;
+	return entry;
+}
+
+void Board::popAccumulator() {
+	accumulatorIndex--;
 }
 
-void Board::restoreAccumulators() {
-	for (int i = 0; i < M; i++) {
-		nnue.accumulator[0][i] = accumulatorHistory.top()[0][i];
-		nnue.accumulator[1][i] = accumulatorHistory.top()[1][i];
+void Board::updateAccumulators() {
+	for (int white = 0; white < 2; white++) {
+		if (accumulatorStack[accumulatorIndex].computed[white])
+			continue;
+
+		// Walk back to the last entry the changes can be applied from, the root is always computed
+		size_t start = accumulatorIndex;
+		while (!accumulatorStack[start].computed[white] && !accumulatorStack[start].refresh[white]) {
+			start--;
+		}
+
+		if (!accumulatorStack[start].computed[white]) {
+			// The king of this perspective moved since then, which changes every feature
+			refreshAccumulator(accumulatorStack[accumulatorIndex].accumulator, white);
+			accumulatorStack[accumulatorIndex].computed[white] = true;
+			continue;
+		}
+
+		// Materialise every entry on the way, so siblings and the parent can start from them.
+		// The perspective's king didn't move on the way, so all entries share the current king square
+		short kingSquare = white ? whiteKingPos : blackKingPos;
+		for (size_t i = start + 1; i <= accumulatorIndex; i++) {
+			AccumulatorEntry& entry = accumulatorStack[i];
+			nnue.updateAccumulator(accumulatorStack[i - 1].accumulator, entry.accumulator, entry.dirtyPieces, white, kingSquare);
+			entry.computed[white] = true;
+		}
+	}
+}
+
+bool Board::accumulatorsMatch() {
+	updateAccumulators();
+	const NNUE::Accumulator& current = accumulatorStack[accumulatorIndex].accumulator;
+	NNUE::Accumulator expected;
+	for (int white = 0; white < 2; white++) {
+		const short perspective = white ? Piece::WHITE : Piece::BLACK;
+		const short kingSquare = white ? whiteKingPos : blackKingPos;
+
+		int activeFeatures[NNUE::MAX_ACTIVE_FEATURES];
+		int activeCount = 0;
+		for (short color = Piece::WHITE; color <= Piece::BLACK; color += Piece::WHITE) {
+			for (short type = Piece::PAWN; type <= Piece::QUEEN; type++) {
+				bitboard pieces = bb.getBitboard(color | type);
+				Bitloop(pieces) {
+					activeFeatures[activeCount++] = nnue.getHalfKPindex(perspective, type, color, getSquare(pieces), kingSquare);
+				}
+			}
+		}
+
+		nnue.recalculateAccumulator(expected, activeFeatures, activeCount, white);
+		if (std::memcmp(expected[white], current[white], nnue.transformerSize() * sizeof(int16_t)) != 0)
+			return false;
 	}
-	// Remove from history
-	accumulatorHistory.pop();
+	return true;
 }
 
 void Board::doMove(const Move* move) {
 	PROFILE_FUNCTION();
 	// Save the old position
 	positionHistory.push_back(currentZobristKey);
-	saveAccumulators();
-	
+	AccumulatorEntry& accumulatorEntry = pushAccumulator();
+
 
 	unsigned short oldEpSquare = gameState.enPassantSquare;
 	gameState.enPassantSquare = 64;
@@ -600,8 +704,8 @@ void Board::doMove(const Move* move) {
 	short pieceTo = move->capturedPiece;
 	short promoResult = move->getPromotionResult();
 
-	// NNUE features
-	std::vector<int> removedFeaturesW, addedFeaturesW, removedFeaturesB, addedFeaturesB;
+	// Changed pieces for the NNUE, only recorded here and applied once the position gets evaluated
+	NNUE::DirtyPieces& dirtyPieces = accumulatorEntry.dirtyPieces;
 
 	if (!gameState.whiteToMove())
 		gameState.fullMoveCount++;
@@ -615,24 +719,25 @@ void Board::doMove(const Move* move) {
 
 	setPiece(to, promoResult);
 	if ((Piece::getType(pieceTo) != Piece::NONE) && !move->isEnPassant()) {
-		// Remove captured piece from hash and NNUE feature halves
+		// Remove captured piece from hash and NNUE features
 		Zobrist::updatePieceHash(currentZobristKey, pieceTo, to);
-		removedFeaturesW.push_back(nnue.getHalfKPindex(Piece::WHITE, Piece::getType(pieceTo), Piece::getColor(pieceTo), to, whiteKingPos));
-		removedFeaturesB.push_back(nnue.getHalfKPindex(Piece::BLACK, Piece::getType(pieceTo), Piece::getColor(pieceTo), to, blackKingPos));
+		dirtyPieces.add(pieceTo, to, NNUE::DirtyPieces::NO_SQUARE);
 	}
 	// Add piece to hash on target square
 	Zobrist::updatePieceHash(currentZobristKey, promoResult, to);
-	// Add piece to feature vector halves
-	addedFeaturesW.push_back(nnue.getHalfKPindex(Piece::WHITE, Piece::getType(promoResult), Piece::getColor(promoResult), to, whiteKingPos));
-	addedFeaturesW.push_back(nnue.getHalfKPindex(Piece::BLACK, Piece::getType(promoResult), Piece::getColor(promoResult), to, blackKingPos));
 	
 	removePiece(from);
 
 	// Remove piece from hash at origin position
 	Zobrist::updatePieceHash(currentZobristKey, pieceFrom, from);
-	// Remove piece from feature vector halves
-	removedFeaturesW.push_back(nnue.getHalfKPindex(Piece::WHITE, Piece::getType(pieceFrom), Piece::getColor(pieceFrom), from, whiteKingPos));
-	removedFeaturesB.push_back(nnue.getHalfKPindex(Piece::BLACK, Piece::getType(pieceFrom), Piece::getColor(pieceFrom), from, blackKingPos));
+	// Move the piece in the NNUE features, a promoted pawn disappears and the new piece appears
+	if (promoResult == pieceFrom) {
+		dirtyPieces.add(pieceFrom, from, to);
+	}
+	else {
+		dirtyPieces.add(pieceFrom, from, NNUE::DirtyPieces::NO_SQUARE);
+		dirtyPieces.add(promoResult, NNUE::DirtyPieces::NO_SQUARE, to);
+	}
 
 	//std::cout << "\nBishops bitboard after " << Move::toString(*move) << ":\n" << bb.toString(bb.getBitboard(Piece::BISHOP | currentPlayer) | bb.getBitboard(Piece::BISHOP | Piece::getOppositeColor(currentPlayer)));
 
@@ -643,12 +748,9 @@ void Board::doMove(const Move* move) {
 			unsigned short rookTo = from + (to - from) / 2;
 			removePiece(rookFrom);
 			Zobrist::updatePieceHash(currentZobristKey, Piece::ROOK | gameState.currentPlayer, rookFrom);
-			removedFeaturesW.push_back(nnue.getHalfKPindex(Piece::WHITE, Piece::ROOK, gameState.currentPlayer, rookFrom, whiteKingPos));
-			removedFeaturesB.push_back(nnue.getHalfKPindex(Piece::BLACK, Piece::ROOK, gameState.currentPlayer, rookFrom, blackKingPos));
 			setPiece(rookTo, Piece::ROOK | gameState.currentPlayer);
 			Zobrist::updatePieceHash(currentZobristKey, Piece::ROOK | gameState.currentPlayer, rookTo);
-			addedFeaturesW.push_back(nnue.getHalfKPindex(Piece::WHITE, Piece::ROOK, gameState.currentPlayer, rookTo, whiteKingPos));
-			addedFeaturesB.push_back(nnue.getHalfKPindex(Piece::BLACK, Piece::ROOK, gameState.currentPlayer, rookTo, blackKingPos));
+			dirtyPieces.add(Piece::ROOK | gameState.currentPlayer, rookFrom, rookTo);
 		}
 		//----------- REMOVE CASTLE RIGHT ---------------------
 		gameState.castleRights &= gameState.whiteToMove() ? 0b0011 : 0b1100;
@@ -660,19 +762,9 @@ void Board::doMove(const Move* move) {
 		else {
 			blackKingPos = to;
 		}
-		//----------- RECALCULATE STM'S ACCUMULATOR -----------------------
-		std::vector<int> activeFeatures;
-		short kingSquare = gameState.whiteToMove() ? whiteKingPos : blackKingPos;
-		// Collect the feature vector halves for both perspectives
-		for (short color = Piece::WHITE; color <= Piece::BLACK; color += Piece::WHITE) {
-			for (short type = Piece::PAWN; type <= Piece::QUEEN; type++) {
-				bitboard pieces = bb.getBitboard(color | type);
-				Bitloop(pieces) {
-					activeFeatures.push_back(nnue.getHalfKPindex(gameState.currentPlayer, type, color, getSquare(pieces), kingSquare));
-				}
-			}
-		}
-		nnue.recalculateAccumulator(activeFeatures, gameState.whiteToMove());
+		//----------- REFRESH STM'S ACCUMULATOR -----------------------
+		// The opponent's accumulator still follows the recorded changes (captured piece, castling rook)
+		accumulatorEntry.refresh[gameState.whiteToMove()] = true;
 	}
 	else {
 		if (Piece::getType(pieceFrom) == Piece::PAWN) {
@@ -683,8 +775,7 @@ void Board::doMove(const Move* move) {
 				// Remove captured pawn from hash
 				Zobrist::updatePieceHash(currentZobristKey, pieceTo, square);
 				// Remove captured pawn from halfKP features
-				removedFeaturesW.push_back(nnue.getHalfKPindex(Piece::WHITE, Piece::PAWN, Piece::getOppositeColor(gameState.currentPlayer), square, whiteKingPos));
-				removedFeaturesB.push_back(nnue.getHalfKPindex(Piece::BLACK, Piece::PAWN, Piece::getOppositeColor(gameState.currentPlayer), square, blackKingPos));
+				dirtyPieces.add(pieceTo, square, NNUE::DirtyPieces::NO_SQUARE);
 			}
 			else if (abs(to - from) == 16) {
 				// Double pawn step
@@ -713,10 +804,6 @@ void Board::doMove(const Move* move) {
 				}
 			}
 		}
-
-		// Incrementally update both accumulators
-		nnue.updateAccumulator(removedFeaturesW, addedFeaturesW, true);
-		nnue.updateAccumulator(removedFeaturesB, addedFeaturesB, false);
 	}
 	// If rook got captured, castle rights might have to be updated
 	if (Piece::getType(pieceTo) == Piece::ROOK) {
@@ -752,38 +839,16 @@ void Board::doMove(const Move* move) {
 }
 
 void Board::doMove(std::string move) {
-	unsigned short from, to;
-	for (int i = 0; i < 63; i++) {
-		if (move.substr(0, 2) == squareNames[i]) from = i;
-		if (move.substr(2, 2) == squareNames[i]) to = i;
-	}
-
-	Move::Promotion promo = Move::Promotion::None;
-
-	if (move.size() > 4) {
-		switch (move[4]) {
-		case 'q':
-			promo = Move::Promotion::ToQueen;
-			break;
-		case 'r':
-			promo = Move::Promotion::ToRook;
-			break;
-		case 'n':
-			promo = Move::Promotion::ToKnight;
-			break;
-		case 'b':
-			promo = Move::Promotion::ToBishop;
-			break;
+	// Look the move up among the legal ones, they already carry the captured piece and the flags (e.g. en passant)
+	generateMoves();
+	for (const Move& legalMove : possibleMoves) {
+		if (Move::toString(legalMove) == move) {
+			Move m = legalMove;
+			doMove(&m);
+			return;
 		}
 	}
-
-	short ep = 0;
-	if ((Piece::getType(getPiece(from) == Piece::PAWN)) && (abs(to - from) == 7 || abs(to - from) == 9)) {
-		ep = 0b1000;
-	}
-
-	Move m(getPiece(from), getPiece(to), from, to, promo | ep);
-	doMove(&m);
+	DEBUG_CERR("Illegal move " + move + " ignored\n");
 }
 
 void Board::undoMove(const Move* move) {
@@ -847,7 +912,7 @@ void Board::undoMove(const Move* move) {
 		gameState.fullMoveCount--;
 	}
 
-	restoreAccumulators();
+	popAccumulator();
 
 	swapCurrentPlayer();
 
@@ -892,6 +957,20 @@ void Board::generateMoves(bool onlyCaptures)
 
 	attackData = bb.getAttackData(gameState.currentPlayer);
 
+	generatePieceMoves(onlyCaptures);
+
+	//pseudoLegalToLegalMoves();
+	//Instrumentor::Get().EndSession();
+}
+
+void Board::generateQuiescenceMoves() {
+	PROFILE_FUNCTION();
+	possibleMoves.clear();
+	// When in check, every legal move is an evasion and has to be considered
+	generatePieceMoves(!attackData.checkExists);
+}
+
+void Board::generatePieceMoves(bool onlyCaptures) {
 	generateKingMoves(onlyCaptures);
 
 	if (attackData.doubleCheck) return;
@@ -901,9 +980,6 @@ void Board::generateMoves(bool onlyCaptures)
 	generateBishopMoves(onlyCaptures);
 	generateRookMoves(onlyCaptures);
 	generateQueenMoves(onlyCaptures);
-
-	//pseudoLegalToLegalMoves();
-	//Instrumentor::Get().EndSession();
 }
 
 void Board::generatePawnMoves(bool onlyCaptures) {
@@ -1304,9 +1380,167 @@ void Board::orderMoves() {
 	}*/
 }
 
+int Board::staticExchangeEvaluation(const Move& move) {
+	const short leastValuableFirst[6] = { Piece::PAWN, Piece::KNIGHT, Piece::BISHOP, Piece::ROOK, Piece::QUEEN, Piece::KING };
+	unsigned short target = move.targetSquare;
+
+	// gain[i] is the material balance from the perspective of the side making the i-th capture
+	int gain[32];
+	int i = 0;
+	gain[0] = Piece::getPieceValue(move.capturedPiece);
+	if (move.isPromotion()) {
+		gain[0] += Piece::getPieceValue(move.getPromotionResult()) - Piece::getPieceValue(Piece::PAWN);
+	}
+	// The piece that can be captured next
+	short victim = move.getPromotionResult();
+
+	bitboard occupied = bb.getOccupied() & ~(bitboard(1) << move.startSquare);
+	if (move.isEnPassant()) {
+		occupied &= ~(bitboard(1) << (Piece::getColor(move.piece) == Piece::WHITE ? target - 8 : target + 8));
+	}
+	bitboard diagonalSliders = bb.getBitboard(Piece::BISHOP | Piece::WHITE) | bb.getBitboard(Piece::BISHOP | Piece::BLACK)
+		| bb.getBitboard(Piece::QUEEN | Piece::WHITE) | bb.getBitboard(Piece::QUEEN | Piece::BLACK);
+	bitboard straightSliders = bb.getBitboard(Piece::ROOK | Piece::WHITE) | bb.getBitboard(Piece::ROOK | Piece::BLACK)
+		| bb.getBitboard(Piece::QUEEN | Piece::WHITE) | bb.getBitboard(Piece::QUEEN | Piece::BLACK);
+
+	bitboard attackers = bb.getAttackersTo(target, occupied);
+	short side = Piece::getOppositeColor(move.piece);
+
+	while (i < 31) {
+		bitboard ownAttackers = attackers & bb.getBitboard(side);
+		if (!ownAttackers) break;
+
+		// Find the least valuable attacker
+		short attackerType = Piece::NONE;
+		bitboard attacker = bitboard(0);
+		for (short type : leastValuableFirst) {
+			attacker = ownAttackers & bb.getBitboard(type | side);
+			if (attacker) {
+				attackerType = type;
+				attacker &= ~attacker + 1;
+				break;
+			}
+		}
+
+		// The king may only capture if the square isn't defended anymore
+		if (attackerType == Piece::KING && (attackers & ~attacker & bb.getBitboard(Piece::getOppositeColor(side)))) break;
+
+		i++;
+		gain[i] = Piece::getPieceValue(victim) - gain[i - 1];
+		// Neither side can gain anything by continuing the exchange
+		if (std::max(-gain[i - 1], gain[i]) < 0) break;
+
+		occupied &= ~attacker;
+		// Add sliders that were hidden behind the capturing piece (x-rays)
+		attackers |= (bb.getBishopAttacks(target, occupied) & diagonalSliders) | (bb.getRookAttacks(target, occupied) & straightSliders);
+		attackers &= occupied;
+
+		victim = attackerType;
+		side = Piece::getOppositeColor(side);
+	}
+
+	// Each side may decide to stop capturing, propagate the best choice back to the first capture
+	while (i > 0) {
+		gain[i - 1] = -std::max(-gain[i - 1], gain[i]);
+		i--;
+	}
+	return gain[0];
+}
+
+void Board::scoreMoves(unsigned int ply, const Move& ttMove) {
+	const float ttMoveScore = 10000000.0f;
+	const float captureScore = 1000000.0f;
+	const float killerScore = 900000.0f;
+	const float counterMoveScore = 800000.0f;
+
+	short color = gameState.whiteToMove() ? 0 : 1;
+	const Move* counterMove = nullptr;
+	if (ply > 0 && plyMoves[ply - 1].piece != Piece::NONE) {
+		counterMove = &counterMoves[plyMoves[ply - 1].piece][plyMoves[ply - 1].targetSquare];
+	}
+
+	for (Move& move : possibleMoves) {
+		if (move.sameAs(ttMove)) {
+			// The best move of an earlier search of this position
+			move.score += ttMoveScore;
+		}
+		else if (!move.isQuiet()) {
+			// Captures and promotions are sorted by their exchange value, losing ones are tried after all quiet moves
+			int exchange = staticExchangeEvaluation(move);
+			move.score += (exchange >= 0 ? captureScore : -captureScore) + exchange;
+		}
+		else if (move.sameAs(killerMoves[ply][0])) {
+			move.score += killerScore;
+		}
+		else if (move.sameAs(killerMoves[ply][1])) {
+			move.score += killerScore - 1000.0f;
+		}
+		else if (counterMove && move.sameAs(*counterMove)) {
+			move.score += counterMoveScore;
+		}
+		else {
+			move.score += historyTable[color][move.startSquare][move.targetSquare];
+		}
+	}
+}
+
+void Board::updateQuietHeuristics(const Move& move, unsigned int depth, unsigned int ply, const std::vector<Move>& quietsTried) {
+	// Killer moves (don't store the same move twice)
+	if (!move.sameAs(killerMoves[ply][0])) {
+		killerMoves[ply][1] = killerMoves[ply][0];
+		killerMoves[ply][0] = move;
+	}
+
+	// Counter move
+	if (ply > 0 && plyMoves[ply - 1].piece != Piece::NONE) {
+		counterMoves[plyMoves[ply - 1].piece][plyMoves[ply - 1].targetSquare] = move;
+	}
+
+	// History: reward the cutoff move, punish the quiet moves that failed to cause it
+	int bonus = std::min(int(16 * depth * depth), 1600);
+	updateHistory(move, bonus);
+	for (const Move& quiet : quietsTried) {
+		updateHistory(quiet, -bonus);
+	}
+}
+
+void Board::updateHistory(const Move& move, int bonus) {
+	int& entry = historyTable[Piece::getColor(move.piece) == Piece::WHITE ? 0 : 1][move.startSquare][move.targetSquare];
+	// Gravity: the bigger the entry already is, the less it grows
+	entry += bonus - entry * abs(bonus) / MAX_HISTORY;
+}
+
+void Board::initReductions() {
+	for (int depth = 0; depth < MAX_PLY; depth++) {
+		for (int moveNumber = 0; moveNumber < MAX_REDUCTION_MOVES; moveNumber++) {
+			if (depth == 0 || moveNumber == 0) {
+				reductions[depth][moveNumber] = 0;
+				continue;
+			}
+			reductions[depth][moveNumber] = (int)(0.75 + std::log(depth) * std::log(moveNumber) / 2.25);
+		}
+	}
+}
+
+void Board::clearSearchHeuristics() {
+	for (int i = 0; i < MAX_PLY; i++) {
+		killerMoves[i][0] = Move::NULLMOVE;
+		killerMoves[i][1] = Move::NULLMOVE;
+		plyMoves[i] = Move::NULLMOVE;
+		excludedMoves[i] = Move::NULLMOVE;
+	}
+	memset(historyTable, 0, sizeof(historyTable));
+	for (int piece = 0; piece < 23; piece++) {
+		for (int square = 0; square < 64; square++) {
+			counterMoves[piece][square] = Move::NULLMOVE;
+		}
+	}
+}
+
 int Board::staticEvaluation() {
 
-	if (NNUE_EVAL) {
+	// Without a network, e.g. if its file is missing, the handcrafted evaluation has to do
+	if (NNUE_EVAL && nnue.isLoaded()) {
 		return evaluateNNUE();
 	}
 
@@ -1329,9 +1563,10 @@ int Board::evaluateMaterial() {
 }
 
 int Board::evaluateNNUE() {
-	float wdlEval = nnue.evaluate(gameState.whiteToMove());
-	// Clamp to 0-1 for broken nets
-	wdlEval = std::max(0.0f, std::min(1.0f, wdlEval));
+	updateAccumulators();
+	float wdlEval = nnue.evaluate(accumulatorStack[accumulatorIndex].accumulator, gameState.whiteToMove());
+	// Clamp to 0-1 for broken nets, keeping away from 0 and 1 where the inverse sigmoid is infinite
+	wdlEval = std::max(0.0001f, std::min(0.9999f, wdlEval));
 	int cpEval = utils::math::invSigmoid(wdlEval, 0, 1.0f / 410.0f);
 	DEBUG_COUT("wdlEval=" + std::to_string(wdlEval) + ", cpEval=" + std::to_string(cpEval) + '\n');
 	return cpEval;
@@ -1446,8 +1681,21 @@ int Board::evaluateQueens() {
 	return queensValue;
 }
 
-int Board::negaMax(unsigned int depth, int alpha, int beta, SearchResults* results, bool firstCall = false, bool allowNull = true) {
-	if (timeOut) return 0;
+template <Board::NodeType nodeType>
+int Board::negaMax(unsigned int depth, unsigned int ply, int alpha, int beta, SearchResults* results) {
+	const bool rootNode = nodeType == ROOT;
+	// Null window nodes only have to prove that they are worse or better than the bound, so they can be pruned harder
+	const bool pvNode = nodeType != NON_PV;
+
+	if (timeOut || checkTimeOut(results)) return 0;
+	// Extensions can't make the line longer than the per ply arrays
+	if (ply >= MAX_PLY - 1) return staticEvaluation();
+	pvLength[ply] = 0;
+	results->selectiveDepth = std::max(results->selectiveDepth, ply);
+	// Set while verifying that this move is singular, the node is then searched without it
+	const Move excludedMove = excludedMoves[ply];
+	// Searching the root without some of its moves (MultiPV, searchmoves) doesn't describe the position either
+	const bool excluding = excludedMove.piece != Piece::NONE || (rootNode && (!rootExcludedMoves.empty() || !searchLimits.searchMoves.empty()));
 	//----------------------- TRANSPOSITION TABLE LOOKUP ---------------------------
 	/*TableEntry* transposition = TranspositionTable::get(currentZobristKey);
 	if (transposition) {
@@ -1456,21 +1704,21 @@ int Board::negaMax(unsigned int depth, int alpha, int beta, SearchResults* resul
 			switch (transposition->type) {
 			case TableEntry::scoreType::EXACT:
 				//DEBUG_COUT(" CAUSES CUTOFF!!\n");
-				if (firstCall) {
+				if (rootNode) {
 					results->bestMove = transposition->bestMove;
 					results->evaluation = transposition->evaluation;
 				}
 				return transposition->evaluation;
 			case TableEntry::scoreType::LOWER_BOUND:
 				//DEBUG_COUT(" sets new lower bound.\n");
-				if (!firstCall && (transposition->evaluation >= beta))
+				if (!rootNode && (transposition->evaluation >= beta))
 					// Beta cutoff with lower bound value
 					return beta;
 				break;
 			case TableEntry::scoreType::UPPER_BOUND:
 				//DEBUG_COUT(" sets new upper bound.\n");
 				// Great alpha value for current search
-				if (!firstCall)
+				if (!rootNode)
 					alpha = transposition->evaluation;
 				else if (transposition->bestMove != Move::NULLMOVE) {
 					results->bestMove = transposition->bestMove;
@@ -1483,95 +1731,236 @@ int Board::negaMax(unsigned int depth, int alpha, int beta, SearchResults* resul
 	}*/
 	// ----------------------------------------------------------------------------
 
-	// Remis by repetition
+	// Remis by repetition (depends on the path to the position, so it is not stored in the table)
 	if (checkForRepetition()) {
-		TranspositionTable::add(currentZobristKey, Move::NULLMOVE, 0, TableEntry::scoreType::EXACT, depth);
 		return 0;
 	}
 
+	// Quiet positions at the horizon don't need the full move list, the quiescence search generates its own.
+	// Only if the king is stuck as well, the full move list is needed to rule out a stalemate
+	if (depth == 0) {
+		attackData = bb.getAttackData(gameState.currentPlayer);
+		const unsigned short kingPos = gameState.whiteToMove() ? whiteKingPos : blackKingPos;
+		const bool kingCanMove = bb.getKingAttacks(kingPos) & ~bb.getBitboard(gameState.currentPlayer) & ~attackData.allAttacks;
+		if (!attackData.checkExists && kingCanMove) {
+			return negaMaxQuiescence(alpha, beta, results, results->depth, ply);
+		}
+	}
+
 	generateMoves();
 
-	// Check- or stalemate
+	// Check- or stalemate (quicker mates get better scores)
 	if (possibleMoves.empty()) {
-		int score = (attackData.checkExists ? -100000 - depth : 0);
-		TranspositionTable::add(currentZobristKey, Move::NULLMOVE, score, TableEntry::scoreType::EXACT, depth);
+		int score = (attackData.checkExists ? -MATE_SCORE + (int)ply : 0);
+		TranspositionTable::add(currentZobristKey, Move::NULLMOVE, scoreToTable(score, ply), TableEntry::scoreType::EXACT, depth);
 		return score;
 	}
 
 	// Remis by 50 Move rule (Mate has precedence)
 	if (gameState.halfMoveCount >= 100) {
-		TranspositionTable::add(currentZobristKey, Move::NULLMOVE, 0, TableEntry::scoreType::EXACT, depth);
 		return 0;
 	}
 
+	//----------------------- MATE DISTANCE PRUNING -----------------------------------
+	// Even mating right now can't beat a shorter mate that was already found elsewhere
+	if (!rootNode) {
+		alpha = std::max(alpha, -MATE_SCORE + (int)ply);
+		beta = std::min(beta, MATE_SCORE - (int)ply - 1);
+		if (alpha >= beta) return alpha;
+	}
+	//---------------------------------------------------------------------------------
+
+	// attackData gets overwritten by the child nodes, so remember it for the move loop
+	const bool inCheck = attackData.checkExists;
+	// Extending is only allowed until the line is one and a half times as long as the nominal depth, so the search can't explode
+	const bool canExtend = 2 * ply < 3 * results->depth;
+
+	//----------------------- CHECK EXTENSION ------------------------------------------
+	// Checks are forcing, don't let the horizon cut off the answer to them
+	if (inCheck && canExtend) {
+		depth++;
+	}
+	//---------------------------------------------------------------------------------
+
 	// If desired depth is reached, return result of a reduced quiet search (allow search depth to double at most)
 	if (depth == 0) {
-		int eval = negaMaxQuiescence(alpha, beta, results, results->depth);
-		TranspositionTable::add(currentZobristKey, Move::NULLMOVE, eval, TableEntry::scoreType::UPPER_BOUND, 0);
-		return eval;
+		return negaMaxQuiescence(alpha, beta, results, results->depth, ply);
 	}
-	
+
+
+	// The static evaluation is meaningless while in check
+	int staticEval = inCheck ? NO_EVALUATION : staticEvaluation();
+	staticEvals[ply] = staticEval;
+	// Positions that got better since our last move deserve a closer look
+	const bool improving = !inCheck && ply >= 2 && staticEvals[ply - 2] != NO_EVALUATION && staticEval > staticEvals[ply - 2];
+
+	if (!pvNode && !inCheck && !excluding) {
+
+		//----------------------- REVERSE FUTILITY PRUNING ---------------------------------
+		// The position is so good that even losing a margin per remaining ply still fails high
+		if (searchOptions.reverseFutilityPruning && depth <= 6 && abs(beta) < MATE_BOUND
+			&& staticEval - 80 * (int)depth >= beta) {
+			return staticEval;
+		}
+		//---------------------------------------------------------------------------------
+
+		//----------------------- RAZORING -------------------------------------------------
+		// The position is so bad that only captures could save it, so verify that with the quiescence search
+		if (searchOptions.razoring && depth <= 2 && abs(alpha) < MATE_BOUND
+			&& staticEval + 250 * (int)depth < alpha) {
+			int evaluation = negaMaxQuiescence(alpha, alpha + 1, results, results->depth, ply);
+			if (evaluation <= alpha) {
+				return evaluation;
+			}
+			// Quiescence search destroyed the move list
+			generateMoves();
+		}
+		//---------------------------------------------------------------------------------
+	}
+
+	// The table is only used for move ordering and singular extensions, not for cutoffs
+	Move ttMove = Move::NULLMOVE;
+	int ttEvaluation = 0;
+	unsigned int ttDepth = 0;
+	TableEntry::scoreType ttType = TableEntry::scoreType::UPPER_BOUND;
+	TableEntry* transposition = TranspositionTable::get(currentZobristKey);
+	if (transposition) {
+		ttMove = transposition->bestMove;
+		ttEvaluation = scoreFromTable(transposition->evaluation, ply);
+		ttDepth = transposition->depth;
+		ttType = transposition->type;
+	}
+
 	// Order Moves before iterating to maximize pruning
+	scoreMoves(ply, ttMove);
 	orderMoves();
 	std::vector<Move> moves = possibleMoves;
+
+	//----------------------- NULL MOVE PRUNING ----------------------------------------
+	// Never skip two moves in a row, that would just return to the same position
+	const bool afterNullMove = ply > 0 && plyMoves[ply - 1].piece == Piece::NONE;
+	if (!pvNode && !inCheck && !excluding && !afterNullMove && staticEval >= beta) {
+		const int nullMoveReduction = 3;
+		// Avoid situations where zugzwang is most likely
+		if (possibleMoves.size() > 5 && depth > nullMoveReduction) {
+			// Skip our move
+			swapCurrentPlayer();
+			plyMoves[ply] = Move::NULLMOVE;
+			// Do a reduced depth search
+			int evaluation = -negaMax<NON_PV>(depth - nullMoveReduction, ply + 1, -beta, -beta+1, results);
+			// Undo stuff
+			swapCurrentPlayer();
+			possibleMoves = moves;
+			// The aborted search returned no real score, it must not be stored
+			if (timeOut) return 0;
+
+			// PRUNE
+			if (evaluation >= beta) {
+				TranspositionTable::add(currentZobristKey, Move::NULLMOVE, scoreToTable(evaluation, ply), TableEntry::scoreType::LOWER_BOUND, depth - nullMoveReduction);
+				return beta;
+			}
+		}
+	}
+	//---------------------------------------------------------------------------------
+
+	//----------------------- SINGULAR EXTENSION --------------------------------------
+	// If the move from the table is much better than all others, it is forced and deserves more depth.
+	// Verify that by searching all other moves with reduced depth against a bound below its evaluation.
+	bool singular = false;
+	if (!rootNode && !excluding && canExtend && depth >= 6 && ttMove.piece != Piece::NONE
+		&& ttDepth + 3 >= depth && ttType != TableEntry::scoreType::UPPER_BOUND && abs(ttEvaluation) < MATE_BOUND) {
+		const int singularBeta = ttEvaluation - 2 * (int)depth;
+		excludedMoves[ply] = ttMove;
+		int evaluation = negaMax<NON_PV>((depth - 1) / 2, ply, singularBeta - 1, singularBeta, results);
+		excludedMoves[ply] = Move::NULLMOVE;
+		possibleMoves = moves;
+		singular = evaluation < singularBeta;
+	}
+	//---------------------------------------------------------------------------------
+
 	Move bestMove = Move::NULLMOVE;
+	std::vector<Move> quietsTried;
+	// Quiet moves after this many can be skipped, if they are not expected to be good
+	const unsigned int lateMoveCount = 3 + depth * depth;
+	const short color = gameState.whiteToMove() ? 0 : 1;
 
 	for (int i = 0; i < possibleMoves.size(); i++) {
-		results->positionsSearched++;
-
-		//----------------------- NULL MOVE PRUNING ----------------------------------------
-		if (allowNull && !firstCall && !attackData.checkExists) {
-			const int nullMoveReduction = 3;
-			// Avoid situations where zugzwang is most likely
-			if (possibleMoves.size() > 5 && depth > nullMoveReduction) {
-				// Skip our move
-				swapCurrentPlayer();
-				// Do a reduced depth search
-				int evaluation = -negaMax(depth - nullMoveReduction, -beta, -beta+1, results, false, false);
-				// Undo stuff
-				swapCurrentPlayer();
+		Move move = possibleMoves[i];
+		if (excluding && move.sameAs(excludedMove)) continue;
+		if (rootNode && isRootMoveExcluded(move)) continue;
+		plyMoves[ply] = move;
+		doMove(&move);
+		// Only late quiet moves can be pruned or reduced, so only they need to know wether they give check
+		const bool lateQuiet = !inCheck && i > 0 && move.isQuiet();
+		const bool givesCheck = lateQuiet && bb.getAttackData(gameState.currentPlayer).checkExists;
+
+		//----------------------- FUTILITY AND LATE MOVE PRUNING ---------------------------
+		// Quiet moves close to the horizon can't raise a hopeless evaluation above alpha,
+		// and late quiet moves are unlikely to be good after a well ordered move list
+		if (!pvNode && lateQuiet && !givesCheck && abs(alpha) < MATE_BOUND) {
+			bool futile = searchOptions.futilityPruning && depth <= 3
+				&& staticEval + 100 + 120 * (int)depth <= alpha;
+			bool late = searchOptions.lateMovePruning && depth <= 3
+				&& (unsigned int)i >= lateMoveCount;
+			if (futile || late) {
+				undoMove(&move);
 				possibleMoves = moves;
-
-				// PRUNE
-				if (evaluation >= beta) {
-					TranspositionTable::add(currentZobristKey, Move::NULLMOVE, evaluation, TableEntry::scoreType::UPPER_BOUND, depth - nullMoveReduction);
-					return beta;
-				}
+				continue;
 			}
 		}
 		//---------------------------------------------------------------------------------
 
-		Move move = possibleMoves[i];
-		doMove(&move);
+		results->positionsSearched++;
+		if (move.isQuiet()) quietsTried.push_back(move);
 
 		//----------------------- LATE MOVE REDUCTION ----------------------------------------
-		const int reduction = (i < 10) ? 1 : 2;
-		bool tryReduction = (i >= 5) && (depth > reduction);
-		// Don't apply late move reduction when: in check; capturing; promoting; giving check;
-		tryReduction &= (!attackData.checkExists && (move.capturedPiece == Piece::NONE) && !move.isPromotion() && !bb.getAttackData(gameState.currentPlayer).checkExists);
-		if (tryReduction) {
-			DEBUG_COUT("DEPTH: " + std::to_string(depth) + ", MOVE #" + std::to_string(i)
-				+ ": " + Move::toString(move) + ", alpha: " + std::to_string(alpha) + ". Doing reduced depth search... ");
-			int evaluation = -negaMax(depth - reduction, -beta, -alpha, results);
-			// Evaluation was not better than best line yet, as expected. PRUNE!
-			if (evaluation <= alpha) {
-						DEBUG_COUT("--> Line can be discarded.\n");
-				undoMove(&move);
-				possibleMoves = moves;
-				continue;
-			} else 
-				DEBUG_COUT("--> Evaluation was better than expected. Doing deeper search.\n");
+		// Late quiet moves are searched with less depth, the later the move and the deeper the search, the more
+		int reduction = 0;
+		if (lateQuiet && !givesCheck && i >= 3 && depth >= 3) {
+			reduction = reductions[std::min(depth, (unsigned int)MAX_PLY - 1)][std::min(i, MAX_REDUCTION_MOVES - 1)];
+			if (pvNode) reduction--;
+			if (!improving) reduction++;
+			// Moves that caused cutoffs elsewhere are reduced less, moves that never did are reduced more
+			reduction -= historyTable[color][move.startSquare][move.targetSquare] / (MAX_HISTORY / 2);
+			// Never drop directly into the quiescence search
+			reduction = std::max(0, std::min(reduction, (int)depth - 2));
 		}
 		//---------------------------------------------------------------------------------
 		
-		int evaluation = -negaMax(depth - 1, -beta, -alpha, results);
+		const unsigned int newDepth = depth - 1 + ((singular && move.sameAs(ttMove)) ? 1 : 0);
 
-		if (firstCall) DEBUG_COUT("Move #" + std::to_string(i) + ' ' + Move::toString(move) + " has evaluation: " + std::to_string(evaluation) + '\n');
+		//----------------------- PRINCIPAL VARIATION SEARCH -------------------------------
+		int evaluation;
+		if (pvNode && i == 0) {
+			// The first move is expected to be the best one, search it with the full window
+			evaluation = -negaMax<PV>(newDepth, ply + 1, -beta, -alpha, results);
+		}
+		else {
+			// Only try to prove that the other moves are worse, using a null window
+			evaluation = -negaMax<NON_PV>(newDepth - reduction, ply + 1, -alpha - 1, -alpha, results);
+			if (reduction > 0 && evaluation > alpha) {
+				// The reduced search was too optimistic about the move being bad, verify with the full depth
+				evaluation = -negaMax<NON_PV>(newDepth, ply + 1, -alpha - 1, -alpha, results);
+			}
+			if (pvNode && evaluation > alpha && evaluation < beta) {
+				// Proof failed, the move might be better. Search again with the full window
+				evaluation = -negaMax<PV>(newDepth, ply + 1, -beta, -alpha, results);
+			}
+		}
+		//---------------------------------------------------------------------------------
+
+		if (rootNode) DEBUG_COUT("Move #" + std::to_string(i) + ' ' + Move::toString(move) + " has evaluation: " + std::to_string(evaluation) + '\n');
 		undoMove(&move);
 		possibleMoves = moves;
+		// The aborted search returned no real score, it must not be stored
+		if (timeOut) {
+			// A move is still needed, if the search ends before the first iteration
+			if (rootNode && results->bestMove == Move::NULLMOVE) results->bestMove = move;
+			return 0;
+		}
 
 		if (evaluation > alpha) {
-			if (firstCall) {
+			if (rootNode) {
 				results->bestMove = move;
 				DEBUG_COUT("New best move: #" + std::to_string(i) + ' ' + Move::toString(results->bestMove) +
 					" with eval=" + std::to_string(evaluation) + " (Alpha was " + std::to_string(alpha) + ")\n");
@@ -1579,116 +1968,381 @@ int Board::negaMax(unsigned int depth, int alpha, int beta, SearchResults* resul
 			}
 			bestMove = move;
 			alpha = evaluation;
+			if (pvNode) updatePrincipalVariation(move, ply);
 		}
-		if (!firstCall && (evaluation >= beta)) {
-			// Prune branch
-			TranspositionTable::add(currentZobristKey, move, evaluation, TableEntry::scoreType::LOWER_BOUND, depth);
+		if (evaluation >= beta) {
+			results->cutoffs++;
+			if (i == 0) results->firstMoveCutoffs++;
+			if (move.isQuiet()) {
+				// The cutoff move itself is the last one in the list
+				quietsTried.pop_back();
+				updateQuietHeuristics(move, depth, ply, quietsTried);
+			}
+			// Prune branch (at the root this means the aspiration window failed high)
+			// Results without the excluded move don't describe the position and must not be stored
+			if (!excluding) TranspositionTable::add(currentZobristKey, move, scoreToTable(evaluation, ply), TableEntry::scoreType::LOWER_BOUND, depth);
 			return beta;
 		}
 	}
-	if (bestMove != Move::NULLMOVE) {
-		TranspositionTable::add(currentZobristKey, bestMove, alpha, TableEntry::scoreType::EXACT, depth);
+	if (bestMove != Move::NULLMOVE && !excluding) {
+		TranspositionTable::add(currentZobristKey, bestMove, scoreToTable(alpha, ply), TableEntry::scoreType::EXACT, depth);
 	}
 	return alpha;
 }
 
 // Search until a quiet position (no check, no captures) is reached
 // TODO: Consider stalemate
-int Board::negaMaxQuiescence(int alpha, int beta, SearchResults* results, int depth) {
+int Board::negaMaxQuiescence(int alpha, int beta, SearchResults* results, int depth, unsigned int ply) {
 	//std::cout << "negaMax(" << depth << ',' << alpha << ',' << beta << ")\n";
-	if (timeOut) return 0;
-	int evaluation = staticEvaluation();
+	if (timeOut || checkTimeOut(results)) return 0;
+	if (ply >= MAX_PLY - 1) return staticEvaluation();
+	results->selectiveDepth = std::max(results->selectiveDepth, ply);
+
+	// Remis by repetition
+	if (checkForRepetition()) {
+		return 0;
+	}
 
-	if (depth == 0) return evaluation;
+	attackData = bb.getAttackData(gameState.currentPlayer);
+	const bool inCheck = attackData.checkExists;
 
-	if (!attackData.checkExists) {
-		if (evaluation >= beta)
-			return beta;
-		alpha = std::max(alpha, evaluation);
+	// Remis by 50 Move Rule (if in check, a mate has precedence)
+	if (gameState.halfMoveCount >= 100 && !inCheck) {
+		return 0;
 	}
-	// Check is not quiet
-	else {
-		generateMoves();
-		if (possibleMoves.empty()) {
-			//std::cout << "Moves list is empty... ";
-			// Checkmate
-			//std::cout << "Checkmate!\n";
-			return -1000000;
+
+	//----------------------- TRANSPOSITION TABLE LOOKUP ---------------------------
+	// Every stored entry was searched at least as deep as the quiescence search
+	Move ttMove = Move::NULLMOVE;
+	TableEntry* transposition = TranspositionTable::get(currentZobristKey);
+	if (transposition) {
+		ttMove = transposition->bestMove;
+		int ttEvaluation = scoreFromTable(transposition->evaluation, ply);
+		switch (transposition->type) {
+		case TableEntry::scoreType::EXACT:
+			return ttEvaluation;
+		case TableEntry::scoreType::LOWER_BOUND:
+			if (ttEvaluation >= beta) return beta;
+			break;
+		case TableEntry::scoreType::UPPER_BOUND:
+			if (ttEvaluation <= alpha) return alpha;
+			break;
 		}
 	}
+	// ----------------------------------------------------------------------------
 
-	if (checkForRepetition()) {
-		// Remis by repetition
-		return 0;
+	//----------------------- STAND PAT --------------------------------------------
+	// Not capturing is an option as well, unless we are in check
+	int standPat = NO_EVALUATION;
+	if (!inCheck) {
+		standPat = staticEvaluation();
+		if (depth == 0)
+			return standPat;
+		if (standPat >= beta)
+			return beta;
+
+		// Delta pruning: not even winning a queen would bring the evaluation back to alpha.
+		// A pawn about to promote can win another queen on top of that
+		const bitboard promotionRank = gameState.whiteToMove() ? bb.seventhRank : bb.secondRank;
+		int maxGain = Piece::getPieceValue(Piece::QUEEN);
+		if (bb.getBitboard(Piece::PAWN | gameState.currentPlayer) & promotionRank)
+			maxGain += Piece::getPieceValue(Piece::QUEEN) - Piece::getPieceValue(Piece::PAWN);
+		if (standPat + maxGain + DELTA_MARGIN < alpha)
+			return alpha;
+
+		alpha = std::max(alpha, standPat);
 	}
+	else if (depth == 0) {
+		return staticEvaluation();
+	}
+	// ----------------------------------------------------------------------------
+
+	generateQuiescenceMoves();
+	if (inCheck && possibleMoves.empty()) {
+		// Checkmate
+		return -MATE_SCORE + (int)ply;
+	}
+	// Remis by 50 Move Rule, the side in check can escape the mate
 	if (gameState.halfMoveCount >= 100) {
-		// Remis by 50 Move Rule
 		return 0;
 	}
 
+	for (Move& move : possibleMoves) {
+		if (move.sameAs(ttMove))
+			move.score = 1000000.0f;
+		// Order captures by the material they win
+		else if (!inCheck)
+			move.score = staticExchangeEvaluation(move);
+	}
 	// Order Moves before iterating to maximize pruning
 	orderMoves();
-	std::vector<Move> captures = possibleMoves;
 
-	for (int i = 0; i < possibleMoves.size(); i++) {
+	// Keep the list of this ply while the children generate their own, swapping avoids copies and allocations
+	std::vector<Move>& moves = quiescenceMoves[ply];
+	moves.swap(possibleMoves);
+
+	const int originalAlpha = alpha;
+	Move bestMove = Move::NULLMOVE;
+	for (const Move& move : moves) {
+		if (!inCheck) {
+			// Captures that lose material won't improve the position (they are sorted to the end)
+			if (move.score < 0) break;
+			// Delta pruning: the captured piece is not enough to raise the evaluation to alpha
+			if (!move.isPromotion() && standPat + Piece::getPieceValue(move.capturedPiece) + DELTA_MARGIN <= alpha) continue;
+		}
+
 		results->positionsSearched++;
-		Move move = possibleMoves[i];
+		results->quiescencePositions++;
 		doMove(&move);
-		generateMoves(true);
-		evaluation = -negaMaxQuiescence(-beta, -alpha, results, depth-1);
+		int evaluation = -negaMaxQuiescence(-beta, -alpha, results, depth-1, ply+1);
 		undoMove(&move);
-		possibleMoves = captures;
+		if (timeOut) return 0;
 		
-		alpha = std::max(alpha, evaluation);
 		if (evaluation >= beta) {
 			// Prune branch
+			TranspositionTable::add(currentZobristKey, move, scoreToTable(evaluation, ply), TableEntry::scoreType::LOWER_BOUND, 0);
 			return beta;
 		}
+		if (evaluation > alpha) {
+			alpha = evaluation;
+			bestMove = move;
+		}
 	}
+	TranspositionTable::add(currentZobristKey, bestMove, scoreToTable(alpha, ply),
+		alpha > originalAlpha ? TableEntry::scoreType::EXACT : TableEntry::scoreType::UPPER_BOUND, 0);
 	return alpha;
 }
 
+int Board::negaMaxMate(unsigned int depth, unsigned int ply, int alpha, int beta, SearchResults* results) {
+	if (timeOut || checkTimeOut(results)) return 0;
+	// No mate can be proven beyond the per ply arrays
+	if (ply >= MAX_PLY - 1) return 0;
+	pvLength[ply] = 0;
+	results->selectiveDepth = std::max(results->selectiveDepth, ply);
+
+	if (ply > 0 && checkForRepetition()) {
+		return 0;
+	}
+
+	generateMoves();
+	if (possibleMoves.empty()) {
+		return attackData.checkExists ? -MATE_SCORE + (int)ply : 0;
+	}
+	// The attacker ran out of moves to deliver the mate
+	if (depth == 0) {
+		return 0;
+	}
+
+	// Even mating right now can't beat a shorter mate that was already found
+	alpha = std::max(alpha, -MATE_SCORE + (int)ply);
+	beta = std::min(beta, MATE_SCORE - (int)ply - 1);
+	if (alpha >= beta) return alpha;
+
+	// The attacker can always give up on the mate, just like the stand pat of the quiescence search
+	const bool attacker = (ply % 2) == 0;
+	if (attacker) {
+		if (0 >= beta) return beta;
+		alpha = std::max(alpha, 0);
+	}
+
+	orderMoves();
+	std::vector<Move> moves = possibleMoves;
+
+	for (int i = 0; i < moves.size(); i++) {
+		Move move = moves[i];
+		doMove(&move);
+		// Only checks are forcing enough for the attacker, the defender answers them with all its moves
+		if (attacker && !bb.getAttackData(gameState.currentPlayer).checkExists) {
+			undoMove(&move);
+			continue;
+		}
+		results->positionsSearched++;
+		int evaluation = -negaMaxMate(depth - 1, ply + 1, -beta, -alpha, results);
+		undoMove(&move);
+
+		// The bound is updated before the cutoff, as the mate distance pruning lets the mating move itself fail high
+		if (evaluation > alpha) {
+			alpha = evaluation;
+			if (ply == 0) {
+				results->bestMove = move;
+				results->evaluation = evaluation;
+			}
+			updatePrincipalVariation(move, ply);
+		}
+		if (alpha >= beta) {
+			return beta;
+		}
+	}
+	return alpha;
+}
+
+int Board::scoreToTable(int score, unsigned int ply) {
+	if (score >= MATE_BOUND) return score + ply;
+	if (score <= -MATE_BOUND) return score - ply;
+	return score;
+}
+
+int Board::scoreFromTable(int score, unsigned int ply) {
+	if (score >= MATE_BOUND) return score - ply;
+	if (score <= -MATE_BOUND) return score + ply;
+	return score;
+}
+
+void Board::updatePrincipalVariation(const Move& move, unsigned int ply) {
+	Move* line = &pvTable[ply * MAX_PLY];
+	const Move* childLine = &pvTable[(ply + 1) * MAX_PLY];
+	line[0] = move;
+	// The child line can't be longer than the rest of the row, because each ply shortens it by one
+	for (unsigned int i = 0; i < pvLength[ply + 1]; i++) {
+		line[i + 1] = childLine[i];
+	}
+	pvLength[ply] = pvLength[ply + 1] + 1;
+}
+
 Board::SearchResults Board::searchBestMove(unsigned int depth) {
+	clearSearchHeuristics();
 	SearchResults searchResults;
 	searchResults.depth = depth;
-	negaMax(depth, -1000000, 1000000, &searchResults, true);
+	negaMax<ROOT>(depth, 0, -INFINITE_SCORE, INFINITE_SCORE, &searchResults);
+	searchResults.principalVariation.assign(pvTable.begin(), pvTable.begin() + pvLength[0]);
 	return searchResults;
 }
 
+Board::SearchResults Board::aspirationSearch(unsigned int depth, int previousEvaluation) {
+	const int infinity = INFINITE_SCORE;
+	int window = 30;
+	int alpha = -infinity;
+	int beta = infinity;
+
+	// Shallow iterations and mate scores are too unstable for a narrow window
+	if (depth >= 4 && abs(previousEvaluation) < MATE_BOUND) {
+		alpha = previousEvaluation - window;
+		beta = previousEvaluation + window;
+	}
+
+	// Statistics are accumulated over all re-searches
+	SearchResults searchResults;
+	searchResults.depth = depth;
+	while (true) {
+		int evaluation = negaMax<ROOT>(depth, 0, alpha, beta, &searchResults);
+		// A fail low leaves no line behind, keep the one of the last search in that case
+		if (pvLength[0] > 0) {
+			searchResults.principalVariation.assign(pvTable.begin(), pvTable.begin() + pvLength[0]);
+		}
+
+		if (timeOut || (evaluation > alpha && evaluation < beta) || (alpha <= -infinity && beta >= infinity)) {
+			return searchResults;
+		}
+
+		// Evaluation is outside of the window, widen it on the side that failed and search again
+		window *= 2;
+		if (evaluation <= alpha) {
+			DEBUG_COUT("Aspiration window failed low at depth " + std::to_string(depth) + '\n');
+			alpha = std::max(-infinity, alpha - window);
+		}
+		else {
+			DEBUG_COUT("Aspiration window failed high at depth " + std::to_string(depth) + '\n');
+			beta = std::min(infinity, beta + window);
+		}
+	}
+}
+
+bool Board::checkTimeOut(const SearchResults* results) {
+	if (!processing) return false;
+	if (searchLimits.nodes > 0 && previousPositions + results->positionsSearched >= searchLimits.nodes) {
+		timeOut = true;
+		return true;
+	}
+	// Only poll the clock every few thousand positions
+	if ((results->positionsSearched & 2047) != 0) return false;
+	timeOut = stopDemanded || timeManager.hardLimitReached();
+	return timeOut;
+}
+
+bool Board::isRootMoveExcluded(const Move& move) const {
+	auto sameMove = [&move](const Move& m) { return m.sameAs(move); };
+	if (std::any_of(rootExcludedMoves.begin(), rootExcludedMoves.end(), sameMove)) return true;
+	return !searchLimits.searchMoves.empty() && std::none_of(searchLimits.searchMoves.begin(), searchLimits.searchMoves.end(), sameMove);
+}
+
 Board::SearchResults Board::iterativeSearch(float time) {
-	std::chrono::time_point<std::chrono::steady_clock> start, end;
-	start = std::chrono::high_resolution_clock::now();
-	end = std::chrono::high_resolution_clock::now();
-	std::chrono::duration<float> duration;
+	timeManager.initMoveTime(time);
+	return timedSearch();
+}
 
+Board::SearchResults Board::timedSearch() {
 	processing = true;
+	timeOut = false;
+	clearSearchHeuristics();
 
 	unsigned int depth = 0;
+	unsigned int positionsSearched = 0;
+	unsigned int quiescencePositions = 0;
 	SearchResults lastSearchResult;
+	// Lines of the last finished iteration, the best one first
+	std::vector<SearchResults> lines;
 
-	while (!stopDemanded && duration.count() * 1000.0f < time) {
+	// There can't be more lines than moves to search
+	generateMoves();
+	const unsigned int rootMoves = (unsigned int)std::count_if(possibleMoves.begin(), possibleMoves.end(),
+		[this](const Move& move) { return !isRootMoveExcluded(move); });
+	const unsigned int lineCount = std::max(1u, std::min(multiPV, rootMoves));
+	const unsigned int maxDepth = searchLimits.depth > 0 ? std::min(searchLimits.depth, (unsigned int)MAX_PLY / 2) : MAX_PLY / 2;
+
+	// Don't start another iteration if it most likely can't be finished in time
+	while (!stopDemanded && !timeManager.softLimitReached() && depth < maxDepth) {
 		depth++;
-		timeOut = false;
-		std::future<SearchResults> future = std::async(&Board::searchBestMove, this, depth);
-
-		while (!(future.wait_for(100ms) == std::future_status::ready)) {
-			end = std::chrono::high_resolution_clock::now();
-			duration = end - start;
-			if (stopDemanded || duration.count() * 1000.0f >= time) {
-				timeOut = true;
-				goto logResults;
+		// Each line is searched without the first moves of the lines found before it
+		std::vector<SearchResults> iterationLines;
+		SearchResults searchResult;
+		for (unsigned int line = 0; line < lineCount; line++) {
+			previousPositions = positionsSearched;
+			searchResult = aspirationSearch(depth, line < lines.size() ? lines[line].evaluation : lastSearchResult.evaluation);
+			// Report the positions of all iterations so far
+			positionsSearched += searchResult.positionsSearched;
+			searchResult.positionsSearched = positionsSearched;
+			quiescencePositions += searchResult.quiescencePositions;
+			searchResult.quiescencePositions = quiescencePositions;
+			if (timeOut) break;
+
+			iterationLines.push_back(searchResult);
+			rootExcludedMoves.push_back(searchResult.bestMove);
+		}
+		rootExcludedMoves.clear();
+
+		if (timeOut) {
+			// Aborted iterations are incomplete, only use them if there is nothing better
+			if (lastSearchResult.bestMove == Move::NULLMOVE) {
+				lastSearchResult = iterationLines.empty() ? searchResult : iterationLines[0];
 			}
+			break;
 		}
-		// Future is ready
-		lastSearchResult = future.get();
-		currentSearch = lastSearchResult;
 
-		logResults:
+		// A later line can turn out better than an earlier one, as it was searched with more information
+		std::stable_sort(iterationLines.begin(), iterationLines.end(),
+			[](const SearchResults& a, const SearchResults& b) { return a.evaluation > b.evaluation; });
+		for (unsigned int line = 0; line < iterationLines.size(); line++) {
+			iterationLines[line].multiPV = line + 1;
+			iterationLines[line].positionsSearched = positionsSearched;
+			iterationLines[line].quiescencePositions = quiescencePositions;
+		}
+		lines = iterationLines;
+
+		lastSearchResult = lines[0];
+		currentSearch = lastSearchResult;
+		timeManager.update(lastSearchResult.bestMove, lastSearchResult.evaluation);
+		if (iterationFinished) {
+			for (const SearchResults& line : lines) {
+				iterationFinished(line);
+			}
+		}
 
 		DEBUG_COUT("Depth: " + std::to_string(lastSearchResult.depth) + "; Eval: " + std::to_string(lastSearchResult.evaluation)
 				+ "; Move: " + Move::toString(lastSearchResult.bestMove) + "; Positions: "
-				+ std::to_string(lastSearchResult.positionsSearched) + "; Time searched: "
-				+ std::to_string(duration.count() * 1000.0f) + "ms\n");
+				+ std::to_string(lastSearchResult.positionsSearched) + "; First move cutoffs: "
+				+ std::to_string(lastSearchResult.firstMoveCutoffs) + '/' + std::to_string(lastSearchResult.cutoffs) + "; Quiescence positions: "
+				+ std::to_string(lastSearchResult.quiescencePositions) + "; Time searched: "
+				+ std::to_string(timeManager.elapsed()) + "ms\n");
 	}
 
 	processing = false;
@@ -1699,6 +2353,46 @@ Board::SearchResults Board::iterativeSearch(float time) {
 	return lastSearchResult;
 }
 
+Board::SearchResults Board::mateSearch(unsigned int moves) {
+	processing = true;
+	timeOut = false;
+
+	unsigned int positionsSearched = 0;
+	SearchResults lastSearchResult;
+
+	// Short mates are found much quicker, so look for them first
+	for (unsigned int mateIn = 1; mateIn <= moves && !stopDemanded; mateIn++) {
+		SearchResults searchResult;
+		searchResult.depth = 2 * mateIn - 1;
+		previousPositions = positionsSearched;
+		negaMaxMate(searchResult.depth, 0, -INFINITE_SCORE, INFINITE_SCORE, &searchResult);
+		positionsSearched += searchResult.positionsSearched;
+		searchResult.positionsSearched = positionsSearched;
+		if (timeOut) break;
+
+		searchResult.principalVariation.assign(pvTable.begin(), pvTable.begin() + pvLength[0]);
+		lastSearchResult = searchResult;
+		currentSearch = lastSearchResult;
+		if (iterationFinished) iterationFinished(lastSearchResult);
+
+		DEBUG_COUT("Mate in " + std::to_string(mateIn) + ": " + (searchResult.evaluation >= MATE_BOUND ? Move::toString(searchResult.bestMove) : "none")
+			+ "; Positions: " + std::to_string(positionsSearched) + "; Time searched: " + std::to_string(timeManager.elapsed()) + "ms\n");
+		if (searchResult.evaluation >= MATE_BOUND) break;
+	}
+
+	// Without a mate every move is as good as any other, but a legal one has to be played
+	if (lastSearchResult.bestMove.piece == Piece::NONE) {
+		generateMoves();
+		if (!possibleMoves.empty()) lastSearchResult.bestMove = possibleMoves[0];
+	}
+
+	processing = false;
+	stopDemanded = false;
+	timeOut = false;
+	currentSearch = lastSearchResult;
+	return lastSearchResult;
+}
+
 // Converts an integer (step) to a short[2] x and y direction
 void Board::stepsToDirection(int steps, short dir[2]) {
 	//std::cout << "Converting steps " << steps << " to direction... ";
@@ -4,10 +4,13 @@
 #include "Bitboard.h"
 #include "util.h"
 #include "NNUE.h"
+#include "TimeManager.h"
 #include <vector>
 #include <stack>
 #include <thread>
 #include <future>
+#include <functional>
+#include <atomic>
 
 #ifdef _DEBUG
 #define DEBUG_COUT(x) (std::cout << (x))
@@ -36,6 +39,42 @@ private:
 
 	bool timeOut;
 
+	// Maximum number of plies the search can go deep
+	static const int MAX_PLY = 128;
+	// Upper bound for the values in the history table
+	static const int MAX_HISTORY = 16384;
+
+	// Two quiet moves per ply that recently caused a beta cutoff
+	Move killerMoves[MAX_PLY][2];
+	// Butterfly table of quiet moves that caused cutoffs, indexed by [color][from][to]
+	int historyTable[2][64][64];
+	// Quiet moves that refuted a move, indexed by [piece][targetSquare] of that move
+	Move counterMoves[23][64];
+	// The moves that lead to the current search node, indexed by ply
+	Move plyMoves[MAX_PLY];
+	// Moves that are left out while testing wether the move from the transposition table is singular, indexed by ply
+	Move excludedMoves[MAX_PLY];
+	// Root moves that already lead a better line of the current MultiPV iteration
+	std::vector<Move> rootExcludedMoves;
+	// Positions of the searches that timedSearch already finished, so the node limit covers all of them
+	unsigned int previousPositions;
+	// Move lists of the quiescence search, indexed by ply. Kept alive so their memory can be reused
+	std::vector<Move> quiescenceMoves[MAX_PLY];
+	// Safety margin of the delta pruning for positional gains of a capture
+	static const int DELTA_MARGIN = 200;
+
+	// Static evaluation of the search nodes, indexed by ply (NO_EVALUATION when in check)
+	int staticEvals[MAX_PLY];
+	static const int NO_EVALUATION = -2000000;
+
+	// Base late move reductions, indexed by [depth][moveNumber]
+	static const int MAX_REDUCTION_MOVES = 64;
+	static int reductions[MAX_PLY][MAX_REDUCTION_MOVES];
+	// Triangular table of principal variations: row ply holds the best line found from that ply on,
+	// stored flat as [ply * MAX_PLY + i] to keep the 300 KB off the stack
+	std::vector<Move> pvTable;
+	unsigned int pvLength[MAX_PLY];
+
 	const int pawnValueMap[64] = {
 	//  A1   B1   C1   D1   E1   F1   G1   H1
 		0  , 0  , 0  , 0  , 0  , 0  , 0  , 0  ,
@@ -129,14 +168,62 @@ private:
 
 public:
 	static Bitboard bb;
+	// Network the engine loads on startup, the UCI option EvalFile can replace it
+	static const std::string defaultNetworkPath;
+
+	// Score of being mated right now, a mate in n plies scores MATE_SCORE - n
+	static const int MATE_SCORE = 100000;
+	// Every score beyond this is a mate
+	static const int MATE_BOUND = MATE_SCORE - MAX_PLY;
+	// Bound of the search window, bigger than any evaluation
+	static const int INFINITE_SCORE = 1000000;
+	// Longest mate mateSearch() can look for, its 2 * moves - 1 plies have to fit the per ply arrays
+	static const unsigned int MAX_MATE_MOVES = (MAX_PLY - 1) / 2;
 
 	struct SearchResults {
 		unsigned int depth;
 		unsigned int positionsSearched;
 		Move bestMove;
 		int evaluation;
+		// Beta cutoffs in total and how many of them were caused by the first move (measures move ordering quality)
+		unsigned int cutoffs, firstMoveCutoffs;
+		// Highest ply reached, including the quiescence search
+		unsigned int selectiveDepth;
+		// Part of the positionsSearched that were searched by the quiescence search
+		unsigned int quiescencePositions;
+		// Expected line of play, starting with the bestMove
+		std::vector<Move> principalVariation;
+		// Rank of this line if several lines are searched (MultiPV), 1 is the best one
+		unsigned int multiPV;
+
+		SearchResults() : depth(0), positionsSearched(0), bestMove(Move::NULLMOVE), evaluation(0), cutoffs(0), firstMoveCutoffs(0), selectiveDepth(0), quiescencePositions(0), multiPV(1) {}
+	};
+
+	// Kind of node in the search tree: the root, a node on the principal variation (full window) or any other node (null window)
+	enum NodeType {
+		ROOT, PV, NON_PV
+	};
+
+	// Forward pruning techniques of the search, each can be switched off via UCI for comparisons
+	struct SearchOptions {
+		bool reverseFutilityPruning;
+		bool futilityPruning;
+		bool razoring;
+		bool lateMovePruning;
+
+		SearchOptions() : reverseFutilityPruning(true), futilityPruning(true), razoring(true), lateMovePruning(true) {}
+	};
+
+	// Limits of timedSearch besides the time, 0 or empty means no limit
+	struct SearchLimits {
+		// Last iteration to search
+		unsigned int depth;
+		// Positions after which the search is aborted, checked exactly so results don't depend on the hardware
+		unsigned int nodes;
+		// The root only searches these moves
+		std::vector<Move> searchMoves;
 
-		SearchResults() : positionsSearched(0), evaluation(0), depth(0), bestMove(Move::NULLMOVE) {}
+		SearchLimits() : depth(0), nodes(0) {}
 	};
 
 	struct GameState {
@@ -156,7 +243,21 @@ public:
 
 	float searchTime;
 	bool processing;
-	bool stopDemanded;
+	// Set by the UCI thread, read by the search thread
+	std::atomic<bool> stopDemanded;
+
+	// Limits the time of the iterative search
+	TimeManager timeManager;
+
+	SearchOptions searchOptions;
+
+	SearchLimits searchLimits;
+
+	// Number of best lines timedSearch looks for, each one without the first moves of the better lines
+	unsigned int multiPV;
+
+	// Gets called by timedSearch after each finished iteration (once per line with MultiPV), e.g. to report the progress to the GUI
+	std::function<void(const SearchResults&)> iterationFinished;
 
 	static short whiteKingPos;
 	static short blackKingPos;
@@ -178,8 +279,29 @@ public:
 	// Zobrist keys of the past positions
 	std::vector<unsigned long long> positionHistory;
 
-	// Accumulators of past positions
-	std::stack<NNUE::Accumulator> accumulatorHistory;
+	// Accumulators of the current position and the positions leading to it, one entry per doMove.
+	// An entry only records which features its move changed, the accumulator itself is computed lazily on evaluation
+	struct AccumulatorEntry {
+		NNUE::Accumulator accumulator;
+		// Wether the perspective's half of the accumulator is up to date
+		bool computed[2];
+		// Set if the perspective's king moved, the deltas can't be applied and it has to be calculated from scratch
+		bool refresh[2];
+		// Pieces the move changed relative to the previous entry
+		NNUE::DirtyPieces dirtyPieces;
+	};
+	std::vector<AccumulatorEntry> accumulatorStack;
+	// Entry of the current position
+	size_t accumulatorIndex;
+
+	// Refresh cache for king moves, one entry per king square. Each perspective keeps the accumulator it had the last time
+	// its king stood on that square, and the pieces it was calculated for. A refresh then only applies the pieces that changed since.
+	struct RefreshEntry {
+		NNUE::Accumulator accumulator;
+		// Bitboards of pawns to queens, white's first, indexed by perspective (white = 1)
+		bitboard pieces[2][10];
+	};
+	std::vector<RefreshEntry> refreshTable;
 
 	std::stack<Move> futureMovesBuffer;
 
@@ -194,14 +316,54 @@ public:
 	void init(std::string fen);
 
 	/// <summary>
-	/// Collects the active features for both sides and calls NNUE::recalculateAccumulator for both.
+	/// Drops the accumulators of previous positions and refreshes both perspectives of the current one.
 	/// For use after new game started / new fen was read.
 	/// </summary>
 	void initAccumulators();
 
-	void saveAccumulators();
+	/// <summary>
+	/// Resets all entries of the refresh table to an empty board, which is just L1's bias.
+	/// </summary>
+	void initRefreshTable();
+
+	/// <summary>
+	/// Calculates one perspective of an accumulator for the current position,
+	/// starting from the refresh table entry of that perspective's king square.
+	/// </summary>
+	/// <param name="accumulator">whose perspective half gets overwritten</param>
+	/// <param name="white">true if it's whites perspective/accumulator</param>
+	void refreshAccumulator(NNUE::Accumulator& accumulator, bool white);
 
-	void restoreAccumulators();
+	/// <summary>
+	/// Moves on to the next accumulator entry and resets it, the caller records the feature changes of its move there.
+	/// </summary>
+	/// <returns>the entry of the new position</returns>
+	AccumulatorEntry& pushAccumulator();
+
+	/// <summary>
+	/// Returns to the accumulator entry of the previous position, which is still valid.
+	/// </summary>
+	void popAccumulator();
+
+	/// <summary>
+	/// Brings both perspectives of the current accumulator up to date. Walks back to the last computed entry
+	/// and applies the recorded changes from there, or recalculates from scratch if a king moved on the way.
+	/// </summary>
+	void updateAccumulators();
+
+	/// <summary>
+	/// Brings the current accumulator up to date and compares it to one calculated from scratch on all active features,
+	/// without the deltas or the refresh table.
+	/// </summary>
+	/// <returns>wether both perspectives match</returns>
+	bool accumulatorsMatch();
+
+	/// <summary>
+	/// Replaces the network used by the evaluation. The cached accumulators belong to the old network, so they get recalculated.
+	/// </summary>
+	/// <param name="path">to a .nnue network file</param>
+	/// <returns>wether the file could be loaded, the old network is kept otherwise</returns>
+	bool loadNetwork(std::string path);
 
 	/// <summary>
 	/// Fills the board with the information given in form of a FEN string.
@@ -256,6 +418,9 @@ public:
 	/// <param name="move"> to be made.</param>
 	void doMove(const Move* move);
 
+	/// <summary>
+	/// Performs a move given in UCI notation (e.g. e7e8q), if it is legal in the current position.
+	/// </summary>
 	void doMove(std::string move);
 
 	/// <summary>
@@ -288,6 +453,9 @@ public:
 
 	bool checkForRepetition();
 
+	/// <returns>the zobrist key of the current position.</returns>
+	unsigned long long getZobristKey() const { return currentZobristKey; }
+
 	void makePlayerMove(const Move* move);
 
 	void makeAiMove();
@@ -299,6 +467,17 @@ public:
 	/// </summary>
 	void generateMoves(bool onlyCaptures = false);
 
+	/// <summary>
+	/// Clears the possibleMoves vector and fills it with the captures, or with all evasions if the player is in check.
+	/// Expects attackData to be up to date for the current player.
+	/// </summary>
+	void generateQuiescenceMoves();
+
+	/// <summary>
+	/// Adds the moves of all pieces of the current player to the possibleMoves vector, using the current attackData.
+	/// </summary>
+	void generatePieceMoves(bool onlyCaptures);
+
 	void generatePawnMoves(bool onlyCaptures);
 
 	void generateKingMoves(bool onlyCaptures);
@@ -313,6 +492,46 @@ public:
 
 	void orderMoves();
 
+	/// <summary>
+	/// Static Exchange Evaluation: plays out all captures on the target square of the move,
+	/// always recapturing with the least valuable attacker (including x-ray attackers behind it).
+	/// </summary>
+	/// <param name="move">that starts the exchange.</param>
+	/// <returns>the material balance of the exchange for the moving side, assuming both sides may stop capturing at any time.</returns>
+	int staticExchangeEvaluation(const Move& move);
+
+	/// <summary>
+	/// Adds the move ordering bonuses to the scores of the possibleMoves: winning and equal captures first,
+	/// then killer moves, the counter move, all other quiet moves sorted by their history score and finally losing captures.
+	/// The move from the transposition table comes before all of them.
+	/// </summary>
+	/// <param name="ply">of the current search node.</param>
+	/// <param name="ttMove">stored for this position in the transposition table, Move::NULLMOVE if there is none.</param>
+	void scoreMoves(unsigned int ply, const Move& ttMove = Move::NULLMOVE);
+
+	/// <summary>
+	/// Updates killer moves, history and counter move table after a quiet move caused a beta cutoff.
+	/// </summary>
+	/// <param name="move">that caused the cutoff.</param>
+	/// <param name="quietsTried">all quiet moves that were searched at this node before the cutoff move.</param>
+	void updateQuietHeuristics(const Move& move, unsigned int depth, unsigned int ply, const std::vector<Move>& quietsTried);
+
+	/// <summary>
+	/// Applies a bonus (or malus, if negative) to the move's history entry.
+	/// Entries are pulled towards zero the closer they get to MAX_HISTORY.
+	/// </summary>
+	void updateHistory(const Move& move, int bonus);
+
+	/// <summary>
+	/// Fills the late move reduction table, growing with the logarithm of both depth and move number.
+	/// </summary>
+	static void initReductions();
+
+	/// <summary>
+	/// Resets killer moves, history and counter moves before a new search.
+	/// </summary>
+	void clearSearchHeuristics();
+
 	int staticEvaluation();
 
 	int evaluateNNUE();
@@ -340,14 +559,83 @@ public:
 	template <short color>
 	int evaluateQueens();
 
-	int negaMax(unsigned int depth, int alpha, int beta, SearchResults* results, bool firstCall, bool allowNull);
+	/// <summary>
+	/// Alpha-beta search of the current position. The node type decides at compile time which bookkeeping and pruning applies:
+	/// only the root stores its best move in the results, only PV nodes collect the principal variation
+	/// and only non-PV nodes (searched with a null window) may be pruned by static evaluation and null moves.
+	/// </summary>
+	/// <returns>the evaluation from the view of the side to move, clamped to [alpha, beta].</returns>
+	template <NodeType nodeType>
+	int negaMax(unsigned int depth, unsigned int ply, int alpha, int beta, SearchResults* results);
+
+	/// <summary>
+	/// Searches captures (or evasions, when in check) until a quiet position is reached, so the evaluation is not taken in the middle of an exchange.
+	/// </summary>
+	/// <param name="depth">left before the static evaluation is returned anyways.</param>
+	/// <param name="ply">of the node, counted from the root of the search.</param>
+	int negaMaxQuiescence(int alpha, int beta, SearchResults* results, int depth, unsigned int ply);
+
+	/// <summary>
+	/// Searches for a forced mate: the attacking side only plays checks, the defending side answers with all its evasions.
+	/// Non-mating lines are scored 0 for both sides.
+	/// </summary>
+	/// <param name="depth">in plies, odd so the attacker plays the last move.</param>
+	/// <returns>the mate score of the shortest forced mate, 0 if none was found.</returns>
+	int negaMaxMate(unsigned int depth, unsigned int ply, int alpha, int beta, SearchResults* results);
+
+	/// <summary>
+	/// Mate scores are stored relative to the position in the transposition table, so they stay valid when reached at another ply.
+	/// </summary>
+	static int scoreToTable(int score, unsigned int ply);
+
+	/// <summary>
+	/// Converts a score from the transposition table back to a score relative to the root.
+	/// </summary>
+	static int scoreFromTable(int score, unsigned int ply);
+
+	/// <summary>
+	/// Stores the move followed by the principal variation of the next ply as the principal variation of this ply.
+	/// </summary>
+	void updatePrincipalVariation(const Move& move, unsigned int ply);
+
+	/// <summary>
+	/// Sets the timeOut flag if a stop was demanded, the hard time limit or the node limit is reached.
+	/// Only checks the clock every few thousand positions to keep the overhead low.
+	/// </summary>
+	/// <returns>wether the running search has to be aborted.</returns>
+	bool checkTimeOut(const SearchResults* results);
 
-	int negaMaxQuiescence(int alpha, int beta, SearchResults* results, int depth);
+	/// <returns>wether the root has to skip the move, because a better MultiPV line starts with it or searchmoves leaves it out.</returns>
+	bool isRootMoveExcluded(const Move& move) const;
 
 	SearchResults searchBestMove(unsigned int depth);
 
+	/// <summary>
+	/// Searches to the given depth with a narrow window around the evaluation of the previous iteration.
+	/// The window is widened on the failing side until the evaluation lies within it.
+	/// </summary>
+	/// <param name="depth">to search to.</param>
+	/// <param name="previousEvaluation">of the last finished iteration.</param>
+	SearchResults aspirationSearch(unsigned int depth, int previousEvaluation);
+
+	/// <summary>
+	/// Runs an iterative search for a fixed amount of time.
+	/// </summary>
+	/// <param name="time">in ms.</param>
 	SearchResults iterativeSearch(float time);
 
+	/// <summary>
+	/// Runs an iterative search until the limits of the timeManager are reached or a stop is demanded.
+	/// </summary>
+	SearchResults timedSearch();
+
+	/// <summary>
+	/// Looks for a forced mate of the side to move with increasing length, until one is found,
+	/// the given number of moves is reached or a stop is demanded.
+	/// </summary>
+	/// <param name="moves">of the side to move, the longest mate to look for.</param>
+	SearchResults mateSearch(unsigned int moves);
+
 	/// <summary>
 	/// Converts a step to a x and y direction by bitshifting.
 	/// </summary>
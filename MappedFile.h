@@ -0,0 +1,59 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+// Read-only view of a whole file, mapped into memory by the operating system instead of being read into a private buffer.
+// Pages are only loaded from the page cache when they are accessed.
+class MappedFile
+{
+private:
+	const char* address;
+	size_t length;
+#ifdef _WIN32
+	// HANDLEs of the file and its mapping object, kept as void* so windows.h stays out of the header
+	void* fileHandle;
+	void* mappingHandle;
+#endif
+
+public:
+	MappedFile();
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	/// <summary>
+	/// Takes over the mapping of the other file, which is closed afterwards. The address of the mapped data doesn't change.
+	/// </summary>
+	MappedFile& operator=(MappedFile&& other) noexcept;
+
+	/// <summary>
+	/// Maps the given file, a previously mapped file gets unmapped first.
+	/// </summary>
+	/// <returns>wether the file could be opened and mapped, empty files can't</returns>
+	bool open(const std::string& path);
+
+	/// <summary>
+	/// Unmaps the file, data() is invalid afterwards.
+	/// </summary>
+	void close();
+
+	/// <summary>
+	/// Moves a file over the target in one step. Processes that mapped the old target keep its data,
+	/// while overwriting it in place would change or truncate the pages under them.
+	/// </summary>
+	/// <returns>wether the file was moved. Windows refuses to replace a target that is still mapped</returns>
+	static bool replace(const std::string& from, const std::string& to);
+
+	bool isOpen() const {
+		return address != nullptr;
+	}
+
+	const char* data() const {
+		return address;
+	}
+
+	size_t size() const {
+		return length;
+	}
+};
@@ -88,4 +88,14 @@ short Move::getPromotionResult() const
 	default:
 		return piece;
 	}
+}
+
+bool Move::isQuiet() const
+{
+	return (Piece::getType(capturedPiece) == Piece::NONE) && !isPromotion();
+}
+
+bool Move::sameAs(const Move& other) const
+{
+	return (startSquare == other.startSquare) && (targetSquare == other.targetSquare) && (flags == other.flags);
 }
\ No newline at end of file
@@ -53,6 +53,12 @@ struct Move {
 	/// <returns>the piece that this move promotes to. If move is not a promotion, returns this->piece.</returns>
 	short getPromotionResult() const;
 
+	/// <returns>wether the move neither captures nor promotes.</returns>
+	bool isQuiet() const;
+
+	/// <returns>wether both moves share start square, target square and flags, ignoring score and game state.</returns>
+	bool sameAs(const Move& other) const;
+
 	bool operator==(const Move& other) {
 		return (this->piece == other.piece) && (this->capturedPiece == other.piece)
 			&& (this->startSquare == other.startSquare) && (this->targetSquare == other.targetSquare)
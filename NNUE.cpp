@@ -1,309 +1,309 @@
 #include "NNUE.h"
-#include "ValidationLoss.hpp"
 #include "Board.h"
-
-NNUE::NNUE() {
+#include "MappedFile.h"
+#include "NetworkFile.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <type_traits>
+#include <utility>
+
+// Accumulator updates and the forward pass use the widest available vector extension, define NNUE_NO_SIMD to force the scalar fallback.
+// MSVC doesn't define __SSE2__, but every x64 cpu supports it
+#if !defined(NNUE_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define NNUE_AVX2
+#elif !defined(NNUE_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define NNUE_SSE2
+#endif
+
+#if defined(NNUE_AVX2)
+typedef __m256i vec_t;
+const int VECTOR_LANES = 16;
+inline vec_t vecLoad(const int16_t* p) { return _mm256_loadu_si256((const __m256i*)p); }
+inline void vecStore(int16_t* p, vec_t v) { _mm256_storeu_si256((__m256i*)p, v); }
+inline vec_t vecAdd(vec_t a, vec_t b) { return _mm256_add_epi16(a, b); }
+inline vec_t vecSub(vec_t a, vec_t b) { return _mm256_sub_epi16(a, b); }
+#elif defined(NNUE_SSE2)
+typedef __m128i vec_t;
+const int VECTOR_LANES = 8;
+inline vec_t vecLoad(const int16_t* p) { return _mm_loadu_si128((const __m128i*)p); }
+inline void vecStore(int16_t* p, vec_t v) { _mm_storeu_si128((__m128i*)p, v); }
+inline vec_t vecAdd(vec_t a, vec_t b) { return _mm_add_epi16(a, b); }
+inline vec_t vecSub(vec_t a, vec_t b) { return _mm_sub_epi16(a, b); }
+#else
+typedef int16_t vec_t;
+const int VECTOR_LANES = 1;
+inline vec_t vecLoad(const int16_t* p) { return *p; }
+inline void vecStore(int16_t* p, vec_t v) { *p = v; }
+inline vec_t vecAdd(vec_t a, vec_t b) { return a + b; }
+inline vec_t vecSub(vec_t a, vec_t b) { return a - b; }
+#endif
+
+// The accumulator is updated in tiles that stay in registers while all changed rows are applied,
+// so each value of it is only loaded and stored once per update
+const int TILE_REGISTERS = 8;
+const int TILE_SIZE = TILE_REGISTERS * VECTOR_LANES;
+
+inline void addRow(vec_t* tile, const int16_t* row) {
+	for (int r = 0; r < TILE_REGISTERS; r++) {
+		tile[r] = vecAdd(tile[r], vecLoad(row + r * VECTOR_LANES));
+	}
 }
 
-NNUE::NNUE(std::string modelPath) {
-	loadModel(modelPath);
+inline void subRow(vec_t* tile, const int16_t* row) {
+	for (int r = 0; r < TILE_REGISTERS; r++) {
+		tile[r] = vecSub(tile[r], vecLoad(row + r * VECTOR_LANES));
+	}
 }
 
-void NNUE::recalculateAccumulator(const std::vector<int> &activeFeatures, bool white) {
+// The dense layers sum up in int32 lanes
+#if defined(NNUE_AVX2)
+const int DENSE_LANES = 8;
+inline vec_t vecLoadBytes(const void* p) { return _mm256_loadu_si256((const __m256i*)p); }
+inline void vecStoreBytes(void* p, vec_t v) { _mm256_storeu_si256((__m256i*)p, v); }
 
-	if (white) 
-		DEBUG_COUT("White accumulator recalculated from scratch.\n");
-	else
-		DEBUG_COUT("Black accumulator recalculated from scratch.\n");
+// Adds the dot product of the 4 unsigned bytes in each int32 lane of u with the 4 signed bytes in w to that lane.
+// The int16 intermediate can't saturate, since the activations are at most 127
+inline vec_t vecDotAdd(vec_t acc, vec_t u, vec_t w) {
+	return _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(u, w), _mm256_set1_epi16(1)));
+}
 
-	// Copy L1's bias
-	for (int i = 0; i < M; i++) {
-		accumulator[white][i] = L1.biases[i];
-	}
+inline int32_t vecHorizontalSum(vec_t v) {
+	__m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+	return _mm_cvtsi128_si32(sum);
+}
+#elif defined(NNUE_SSE2)
+const int DENSE_LANES = 4;
+inline vec_t vecLoadBytes(const void* p) { return _mm_loadu_si128((const __m128i*)p); }
+inline void vecStoreBytes(void* p, vec_t v) { _mm_storeu_si128((__m128i*)p, v); }
+
+// Without SSSE3 there is no multiplication of bytes, so even and odd bytes get widened to 16 bit separately
+inline vec_t vecDotAdd(vec_t acc, vec_t u, vec_t w) {
+	const vec_t uEven = _mm_srli_epi16(_mm_slli_epi16(u, 8), 8);
+	const vec_t uOdd = _mm_srli_epi16(u, 8);
+	const vec_t wEven = _mm_srai_epi16(_mm_slli_epi16(w, 8), 8);
+	const vec_t wOdd = _mm_srai_epi16(w, 8);
+	return _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(uEven, wEven), _mm_madd_epi16(uOdd, wOdd)));
+}
 
-	// Add the weights for active feature's column
-	for (int a : activeFeatures) {
-		// Calculate Half Piece feature index
-		int halfP = a - (a % 65);
-		for (int i = 0; i < M; i++) {
-			accumulator[white][i] += L1.weights[a][i];
-			accumulator[white][i] += L1.weights[halfP][i];
-		}
-	}
+inline int32_t vecHorizontalSum(vec_t v) {
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0x4E));
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0xB1));
+	return _mm_cvtsi128_si32(v);
 }
+#endif
 
-void NNUE::updateAccumulator(const std::vector<int>& removedFeatures, const std::vector<int>& addedFeatures, bool white) {
-	if (white)
-		DEBUG_COUT("White accumulator updated incrementally.\n");
-	else
-		DEBUG_COUT("Black accumulator updated incrementally.\n");
+// Dividing by QB in the hidden layers is a shift
+const int QB_SHIFT = 6;
+static_assert(1 << QB_SHIFT == QB, "QB has to be a power of 2");
+static_assert(QL1_SHIFT >= 1, "The clipped ReLU rounds with half of the step QL1 / QA");
 
-	// Subtract weights of removed Features
-	for (int r : removedFeatures) {
-		// Calculate Half Piece Feature index
-		int halfP = r - (r % 65);
-		for (int i = 0; i < M; i++) {
-			accumulator[white][i] -= L1.weights[r][i];
-			accumulator[white][i] -= L1.weights[halfP][i];
-		}
-	}
-	// Add weights of added features
-	for (int a : addedFeatures) {
-		int halfP = a - (a % 65);
-		for (int i = 0; i < M; i++) {
-			accumulator[white][i] += L1.weights[a][i];
-			accumulator[white][i] += L1.weights[halfP][i];
-		}
+NNUE::NNUE() : architecture(Architecture::NONE), clippedParameters(0) {
+}
+
+NNUE::NNUE(std::string networkPath) : architecture(Architecture::NONE), clippedParameters(0) {
+	if (!load(networkPath)) {
+		std::cerr << "Failed to load network " << networkPath << '\n';
 	}
 }
 
-void NNUE::crelu(int size, const float* input, float* output) {
-	for (int i = 0; i < size; i++) {
-		// Clip value between 0 and 1
-		output[i] = std::min(std::max(0.0f, input[i]), 1.0f);
+template <typename Function>
+void NNUE::withNetwork(Function&& function) {
+	switch (architecture) {
+	case Architecture::SMALL:
+		function(smallNetwork);
+		break;
+	case Architecture::DEFAULT:
+		function(defaultNetwork);
+		break;
+	case Architecture::LARGE:
+		function(largeNetwork);
+		break;
+	default:
+		break;
 	}
 }
 
-float NNUE::evaluate(bool whiteToMove) {
-	float input[2 * M];
-	// Get the accumulators as one vector in the right order
-	for (int i = 0; i < M; i++) {
-		input[i] = accumulator[whiteToMove][i];
-		input[i + M] = accumulator[!whiteToMove][i];
+int NNUE::transformerSize() const {
+	switch (architecture) {
+	case Architecture::SMALL:
+		return SmallNetwork::TRANSFORMER_SIZE;
+	case Architecture::DEFAULT:
+		return DefaultNetwork::TRANSFORMER_SIZE;
+	case Architecture::LARGE:
+		return LargeNetwork::TRANSFORMER_SIZE;
+	default:
+		return 0;
 	}
+}
 
-	float output[2 * M];
-	// Activation function for accumulator results (first hidden layer)
-	crelu(2 * M, input, output);
+void NNUE::recalculateAccumulator(Accumulator& accumulator, const int* activeFeatures, int activeCount, bool white) {
+	withNetwork([&](const auto& net) { recalculateAccumulator(net, accumulator, activeFeatures, activeCount, white); });
+}
 
-	// second hidden layer (write output into old input buffer)
-	linear<M * 2, K>(L2, output, input);
-	crelu(K, input, output);
+void NNUE::updateAccumulator(const Accumulator& previous, Accumulator& accumulator, const int* removedFeatures, int removedCount, const int* addedFeatures, int addedCount, bool white) {
+	withNetwork([&](const auto& net) { updateAccumulator(net, previous, accumulator, removedFeatures, removedCount, addedFeatures, addedCount, white); });
+}
 
-	// third hidden layer
-	linear<K, K>(L3, output, input);
-	crelu(K, input, output);
+float NNUE::evaluate(const Accumulator& accumulator, bool whiteToMove) {
+	float result = 0;
+	withNetwork([&](const auto& net) { result = evaluate(net, accumulator, whiteToMove); });
+	return result;
+}
 
-	// Output layer
-	linear<K, 1>(L4, output, input);
-
-	return input[0];
-}
-
-void NNUE::train(bool newNet, std::string modelPath, std::string dataPath, std::string valPath, double stepSize, int batchSize, int maxIterations, std::string predPath) {
-	arma::sp_mat sparseMatrix;
-	sparseMatrix.load(dataPath, arma::coord_ascii);
-	arma::mat trainData = (arma::mat) sparseMatrix.t();
-	
-	// Shuffle data
-	/*srand(time(NULL));
-	for (int i = 0; i < trainData.n_cols; i++) {
-		// Swap 2 random columns
-		trainData.swap_cols(rand() % trainData.n_cols, rand() % trainData.n_cols);
-	}*/
-
-	// Cut the trainLabels from the last row of the trainingData
-	arma::mat trainLabels = trainData.submat(trainData.n_rows - 1, 0, trainData.n_rows - 1, trainData.n_cols - 1);
-	trainData = trainData.submat(0, 0, trainData.n_rows - 2, trainData.n_cols - 1);
-
-	// Load validation data
-	sparseMatrix.load(valPath, arma::coord_ascii);
-	sparseMatrix = sparseMatrix.t();
-	arma::mat validationData = (arma::mat)sparseMatrix.submat(0, 0, sparseMatrix.n_rows - 2, sparseMatrix.n_cols - 1);
-	arma::mat validationLabels = (arma::mat)sparseMatrix.submat(sparseMatrix.n_rows - 1, 0, sparseMatrix.n_rows - 1, sparseMatrix.n_cols - 1);
-
-	mlpack::ann::FFN<lossFunction> network;
-
-	if (newNet) {
-		// L1
-		network.Add<mlpack::ann::LinearBitSplit<> >(2 * N, 2 * M);
-		network.Add<mlpack::ann::ClippedReLULayer<>>();
-		// L2									 
-		network.Add<mlpack::ann::Linear<> >(2 * M, K);
-		network.Add<mlpack::ann::ClippedReLULayer<>>();
-		// L3									 
-		network.Add<mlpack::ann::Linear<> >(K, K);
-		network.Add<mlpack::ann::ClippedReLULayer<>>();
-		// L4
-		network.Add<mlpack::ann::Linear<> >(K, 1);
-	}
-	else {
-		mlpack::data::Load(modelPath + "\\net.bin", "network", network);
-		// Create backup
-		mlpack::data::Save(modelPath + "\\net_backup.bin", "network", network, false);
-	}
-	
-	// Instantiate some Optimizer (Based on SGD)
-	//ens::StandardSGD optimizer(stepSize, batchSize, maxIterations, -1);
-	//ens::SPALeRASGD<> optimizer(stepSize, batchSize, maxIterations, -1);
-	ens::Adam optimizer(stepSize, batchSize, 0.9, 0.9999999999, 1e-08, maxIterations, -1);
-
-	// Open log streams
-	std::ofstream lossOutput, valLossOutput, reportOutput, dataOutput;
-	lossOutput.open(modelPath + "\\loss.txt", std::ios_base::app);
-	valLossOutput.open(modelPath + "\\validationLoss.txt", std::ios_base::app);
-	reportOutput.open(modelPath + "\\report.txt", std::ios_base::app); 
-
-	// If there is no path specified for the predicition results, just put them in the model folder
-	if (predPath == "") predPath = modelPath;
-
-	// TRAIN THE MODEL
-	network.Train(trainData, trainLabels, optimizer,
-		/*Callbacks*/
-		ens::ProgressBar(), /*ens::Report(0.1, reportOutput, 1),*/ ens::PrintLoss(lossOutput),
-		ens::ValidationLoss(network, validationData, validationLabels, predPath, 1, valLossOutput, true, 10));
-
-	mlpack::data::Save(modelPath + "\\net.bin", "network", network, false);
-
-	lossOutput.close();
-	valLossOutput.close();
-	reportOutput.close();
-}
-
-void NNUE::train(bool newNet, std::string modelPath, double stepSize, int batchSize, const TrainSession& session) {
-
-	std::cout << "Starting automized training session with:\n"
-		<< '\t' << session.dataPerTraining << " samples per training\n"
-		<< "\tSplit into " << session.dataChunks << " chunks in ranges of size " << session.chunkSize << '\n'
-		<< '\t' << session.shift << " sample shift after each training\n"
-		<< '\t' << session.epochsPerTraining << " epochs per training\n"
-		<< '\t' << session.trainings << " total trainings.\n\n";
-
-	if (newNet) {
-		// Create the required subfolders for training
-		bool check = _mkdir((modelPath + "\\trainData").c_str());
-		if (!check) {
-			std::cout << "Output directory for formatted training data created.\n";
+template <typename Net>
+void NNUE::recalculateAccumulator(const Net& net, Accumulator& accumulator, const int* activeFeatures, int activeCount, bool white) {
+	static_assert(Net::TRANSFORMER_SIZE % TILE_SIZE == 0, "Accumulator size has to be a multiple of the tile size");
+
+	if (white) 
+		DEBUG_COUT("White accumulator recalculated from scratch.\n");
+	else
+		DEBUG_COUT("Black accumulator recalculated from scratch.\n");
+
+	int16_t* acc = accumulator[white];
+	vec_t tile[TILE_REGISTERS];
+	for (int t = 0; t < Net::TRANSFORMER_SIZE; t += TILE_SIZE) {
+		// Start with L1's bias
+		for (int r = 0; r < TILE_REGISTERS; r++) {
+			tile[r] = vecLoad(net.L1.biases.data() + t + r * VECTOR_LANES);
 		}
-		else {
-			std::cout << "Failed to create directory. Aborting...\n";
-			return;
+		// Add the weights for active feature's column
+		for (int a = 0; a < activeCount; a++) {
+			addRow(tile, net.L1.row(foldedIndex(activeFeatures[a])) + t);
+		}
+		for (int r = 0; r < TILE_REGISTERS; r++) {
+			vecStore(acc + t + r * VECTOR_LANES, tile[r]);
 		}
 	}
+}
 
-	// File for saving the data boundaries
-	std::ofstream dataFile(modelPath + "\\trainData\\usedData.csv", std::ios_base::app);
-
-	for (int i = 0; i < session.trainings; i++) {
-		// Get and format the training data
-		int dataMinIndex, dataMaxIndex;
-		arma::sp_mat matrixLoader, trainData;
-
-		std::cout << "\n\nFormatting data for training #" << i + 1 << " ......... ";
-		for (int j = 0; j < session.dataChunks; j++) {
-			int from = session.offset + j * session.chunkSize + i * session.shift;
-			if (!j) dataMinIndex = from;
-			int to = session.offset + j * session.chunkSize + i * session.shift + session.dataPerTraining / session.dataChunks;
-			if (j == session.dataChunks - 1) dataMaxIndex = to;
-
-			std::string outPath = modelPath + "\\trainData\\" + std::to_string(j+1) + "_1.csv";
-			std::cout << "\nData indices: " << from << " - " << to << '\n';
-			formatDataset(session.trainDataPath, outPath, from, to);
-			std::cout << "Formatting finished.\n";
+template <typename Net>
+void NNUE::updateAccumulator(const Net& net, const Accumulator& previous, Accumulator& accumulator, const int* removedFeatures, int removedCount,
+	const int* addedFeatures, int addedCount, bool white) {
+	if (white)
+		DEBUG_COUT("White accumulator updated incrementally.\n");
+	else
+		DEBUG_COUT("Black accumulator updated incrementally.\n");
 
-			// Immediately load and concatenate the formatted matrix
-			matrixLoader.load(outPath, arma::coord_ascii);
-			trainData = arma::join_cols(trainData, matrixLoader);
+	const int16_t* prev = previous[white];
+	int16_t* acc = accumulator[white];
+	vec_t tile[TILE_REGISTERS];
+	for (int t = 0; t < Net::TRANSFORMER_SIZE; t += TILE_SIZE) {
+		for (int r = 0; r < TILE_REGISTERS; r++) {
+			tile[r] = vecLoad(prev + t + r * VECTOR_LANES);
+		}
+		// Subtract weights of removed Features
+		for (int r = 0; r < removedCount; r++) {
+			subRow(tile, net.L1.row(foldedIndex(removedFeatures[r])) + t);
+		}
+		// Add weights of added features
+		for (int a = 0; a < addedCount; a++) {
+			addRow(tile, net.L1.row(foldedIndex(addedFeatures[a])) + t);
+		}
+		for (int r = 0; r < TILE_REGISTERS; r++) {
+			vecStore(acc + t + r * VECTOR_LANES, tile[r]);
 		}
-		// Save the concatenated matrix
-		trainData.save(modelPath + "\\trainData\\concat.csv", arma::coord_ascii);
-
-		// Save the data boundaries
-		dataFile << dataMinIndex << "," << dataMaxIndex << "\n";
-
-		// Create a new folder for the predictions to be saved into
-		std::string predictionsPath = modelPath + "\\predictionsFromTraining" + std::to_string(i);
-		_mkdir(predictionsPath.c_str());
-
-		// Train
-		std::cout << "Starting training #" << i + 1 << "...\n";
-		train((i == 0) && newNet, modelPath, modelPath + "\\trainData\\concat.csv", session.valDataPath, stepSize, batchSize, session.dataPerTraining * session.epochsPerTraining, predictionsPath);
-		std::cout << "\nTraining finished.\n\n";
 	}
-	dataFile.close();
 }
 
-void NNUE::formatDataset(std::string inPath, std::string outPath, int from, int to) {
-	std::string line;
-	std::string fen;
-	std::ifstream input(inPath);
-	std::ofstream output(outPath);
-
-	// Create a board to help with fen reading
-	Board board;
-	// First line is header
-	std::getline(input, line);
-
-	unsigned long long row = 0;
-
-	for (int i = 0; i < from; i++) {
-		std::getline(input, line);
+void NNUE::updateAccumulator(const Accumulator& previous, Accumulator& accumulator, const DirtyPieces& dirtyPieces, bool white, short kingSquare) {
+	const short perspective = white ? Piece::WHITE : Piece::BLACK;
+	int removedFeatures[DirtyPieces::MAX_PIECES], addedFeatures[DirtyPieces::MAX_PIECES];
+	int removedCount = 0, addedCount = 0;
+	for (int i = 0; i < dirtyPieces.count; i++) {
+		const DirtyPieces::DirtyPiece& dirty = dirtyPieces.pieces[i];
+		const short type = Piece::getType(dirty.piece);
+		if (type == Piece::KING)
+			continue;
+		if (dirty.from != DirtyPieces::NO_SQUARE)
+			removedFeatures[removedCount++] = getHalfKPindex(perspective, type, Piece::getColor(dirty.piece), dirty.from, kingSquare);
+		if (dirty.to != DirtyPieces::NO_SQUARE)
+			addedFeatures[addedCount++] = getHalfKPindex(perspective, type, Piece::getColor(dirty.piece), dirty.to, kingSquare);
 	}
+	updateAccumulator(previous, accumulator, removedFeatures, removedCount, addedFeatures, addedCount, white);
+}
 
-	while (std::getline(input, line) && row < (to - from)) {
-		// label and value are comma-separated
-		fen = line.substr(0, line.find(','));
-		board.readPosFromFEN(fen);
-		//board.print();
-		std::string e = line.substr(line.find(',')+1); 
-		int evalCP;
-		float evalWDL;
-
-		// Ignore samples were there is a forced mate
-		if (e.find('#') == std::string::npos) {
-			evalCP = std::stoi(e);
-			if (!board.gameState.whiteToMove()) {
-				evalCP = -evalCP;
-			}
-			// Transform evaluation from centipawns to win/draw/loss (0/0.5/1.0)
-			evalWDL = utils::math::sigmoid(evalCP, 0, 1.0f / 410.0f);
-
-
-			// Coordinate list format for sparse matrices:
-			// <row> <column> <nonzero-value>
-			std::string coordinateList = getHalfKPcoordinateList(row);
-			// Append value
-			coordinateList += std::to_string(row) + " 1300 " + std::to_string(evalWDL) + '\n';
-
-			output << coordinateList;
-		}
-		row++;
+void NNUE::crelu(int size, const int16_t* input, uint8_t* output) {
+	int i = 0;
+#if defined(NNUE_AVX2)
+	const vec_t max = _mm256_set1_epi8(QA);
+	const vec_t half = _mm256_set1_epi16(1 << (QL1_SHIFT - 1));
+	for (; i + 32 <= size; i += 32) {
+		// Scale down from QL1 to QA (rounded), the saturating add keeps the largest values from wrapping around
+		const vec_t low = _mm256_srai_epi16(_mm256_adds_epi16(vecLoad(input + i), half), QL1_SHIFT);
+		const vec_t high = _mm256_srai_epi16(_mm256_adds_epi16(vecLoad(input + i + 16), half), QL1_SHIFT);
+		// Packing saturates negative values to 0, but works within 128 bit lanes, so the 64 bit blocks have to be reordered
+		vec_t packed = _mm256_packus_epi16(low, high);
+		packed = _mm256_permute4x64_epi64(packed, 0xD8);
+		vecStoreBytes(output + i, _mm256_min_epu8(packed, max));
+	}
+#elif defined(NNUE_SSE2)
+	const vec_t max = _mm_set1_epi8(QA);
+	const vec_t half = _mm_set1_epi16(1 << (QL1_SHIFT - 1));
+	for (; i + 16 <= size; i += 16) {
+		// Scale down from QL1 to QA (rounded), the saturating add keeps the largest values from wrapping around
+		const vec_t low = _mm_srai_epi16(_mm_adds_epi16(vecLoad(input + i), half), QL1_SHIFT);
+		const vec_t high = _mm_srai_epi16(_mm_adds_epi16(vecLoad(input + i + 8), half), QL1_SHIFT);
+		// Packing saturates negative values to 0
+		vec_t packed = _mm_packus_epi16(low, high);
+		vecStoreBytes(output + i, _mm_min_epu8(packed, max));
+	}
+#endif
+	for (; i < size; i++) {
+		// Scale down to QA (rounded) and clip value between 0 and 1
+		output[i] = (uint8_t)std::min(std::max(0, ((int)input[i] + (1 << (QL1_SHIFT - 1))) >> QL1_SHIFT), QA);
 	}
-
-	input.close();
-	output.close();
 }
 
-void NNUE::predictTest(std::string modelPath, std::string testdataPath, std::string outputName) {
-	arma::sp_mat sparseMatrix;
-	sparseMatrix.load(testdataPath, arma::coord_ascii);
-	sparseMatrix = sparseMatrix.t();
-
-	arma::mat data = (arma::mat)sparseMatrix.submat(0, 0, sparseMatrix.n_rows - 2, sparseMatrix.n_cols - 1);
-	// Get the labels from the last row of the data
-	arma::mat labels = (arma::mat)sparseMatrix.submat(sparseMatrix.n_rows - 1, 0, sparseMatrix.n_rows - 1, sparseMatrix.n_cols - 1);
-
-	arma::mat prediction;
-	mlpack::ann::FFN<lossFunction> network;
-	mlpack::data::Load(modelPath + "\\net.bin", "net", network);
+template <typename Net>
+float NNUE::evaluate(const Net& net, const Accumulator& accumulator, bool whiteToMove) {
+	const int transformerSize = Net::TRANSFORMER_SIZE, hidden1Size = Net::HIDDEN1_SIZE, hidden2Size = Net::HIDDEN2_SIZE;
+	uint8_t input[2 * transformerSize];
+	// Activation function for accumulator results (first hidden layer), stm's accumulator first
+	crelu(transformerSize, accumulator[whiteToMove], input);
+	crelu(transformerSize, accumulator[!whiteToMove], input + transformerSize);
 
-	// Output log
-	std::ofstream predictOut(modelPath + outputName);
-	
-	double errorSum = 0;
+	// second and third hidden layer
+	uint8_t hidden1[hidden1Size], hidden2[hidden2Size];
+	linear<transformerSize * 2, hidden1Size>(net.L2, input, hidden1);
+	linear<hidden1Size, hidden2Size>(net.L3, hidden1, hidden2);
 
-	for (int i = 0; i < data.n_cols; i++) {
-		auto column = data.col(i);
-		network.Predict(column, prediction);
-		double pred = prediction[0];
-		double label = labels[i];
-		double error = std::abs(pred - label);
-		errorSum += error;
-		std::cout << "Prediction for #" << i << " : " << pred << " (Label: " << labels[i] << ", off by " << std::abs(pred - labels[i]) << ")\n";
-		// Write it all to the log file
-		predictOut << pred << ',' << label << ',' << error << '\n';
+	// Output layer
+	int32_t output = net.L4.biases[0];
+#if defined(NNUE_AVX2)
+	static_assert(hidden2Size % 32 == 0, "Output layer inputs are processed in blocks of 32");
+	vec_t sum = _mm256_setzero_si256();
+	for (int i = 0; i < hidden2Size; i += 32) {
+		// Widen the activations to 16 bit to multiply them with the int16 weights
+		const vec_t low = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(hidden2 + i)));
+		const vec_t high = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(hidden2 + i + 16)));
+		sum = _mm256_add_epi32(sum, _mm256_madd_epi16(low, vecLoad(net.L4.weights.data() + i)));
+		sum = _mm256_add_epi32(sum, _mm256_madd_epi16(high, vecLoad(net.L4.weights.data() + i + 16)));
+	}
+	output += vecHorizontalSum(sum);
+#elif defined(NNUE_SSE2)
+	static_assert(hidden2Size % 16 == 0, "Output layer inputs are processed in blocks of 16");
+	vec_t sum = _mm_setzero_si128();
+	for (int i = 0; i < hidden2Size; i += 16) {
+		const vec_t bytes = vecLoadBytes(hidden2 + i);
+		sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_unpacklo_epi8(bytes, _mm_setzero_si128()), vecLoad(net.L4.weights.data() + i)));
+		sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_unpackhi_epi8(bytes, _mm_setzero_si128()), vecLoad(net.L4.weights.data() + i + 8)));
 	}
-	std::cout << "AVERAGE ERROR: " << errorSum / data.n_cols;
+	output += vecHorizontalSum(sum);
+#else
+	for (int i = 0; i < hidden2Size; i++) {
+		output += hidden2[i] * net.L4.weights[i];
+	}
+#endif
+
+	return output / float(QA * QO);
 }
 
 unsigned int NNUE::getHalfPieceIndex(short perspective, short square, short pieceType, short our) {
@@ -321,100 +321,237 @@ unsigned int NNUE::getHalfKPindex(short perspective, short pieceType, short piec
 	return p + kingSquare + 1;
 }
 
-std::string NNUE::getHalfKPcoordinateList(unsigned long long row) {
-	std::string cl;
+// Rounds to the nearest integer and clips to the range of the type
+template <typename T>
+static T quantizeValue(double value, int scale, unsigned int& clipped) {
+	const double min = std::numeric_limits<T>::min(), max = std::numeric_limits<T>::max();
+	double q = std::round(value * scale);
+	if (q < min || q > max) {
+		clipped++;
+		q = std::min(std::max(q, min), max);
+	}
+	return (T)q;
+}
 
-	unsigned short kingSTM = Board::gameState.whiteToMove() ? Board::whiteKingPos : Board::blackKingPos;
-	unsigned short kingNotSTM = Board::gameState.whiteToMove() ? Board::blackKingPos : Board::whiteKingPos;
-	unsigned short pieceSquare;
+template <typename Net>
+static bool hasSizes(int transformerSize, int hidden1Size, int hidden2Size) {
+	return Net::TRANSFORMER_SIZE == transformerSize && Net::HIDDEN1_SIZE == hidden1Size && Net::HIDDEN2_SIZE == hidden2Size;
+}
 
-	// Each word holds 64 features
-	unsigned long long* words = new unsigned long long[(2 * N) / 64];
-	memset(words, 0ull, sizeof(words) * ((2 * N) / 64));
+void NNUE::releaseNetworks() {
+	smallNetwork = SmallNetwork();
+	defaultNetwork = DefaultNetwork();
+	largeNetwork = LargeNetwork();
+	architecture = Architecture::NONE;
+	network.close();
+}
 
-	for (short piece = Piece::PAWN; piece <= Piece::QUEEN; piece++) {
-		for (short color = Piece::WHITE; color <= Piece::BLACK; color+=8) {
+bool NNUE::quantize(const double* const layerParameters[4], int transformerSize, int hidden1Size, int hidden2Size) {
+	// Loaded layers are views into the read-only mapping, quantising needs memory of their own
+	releaseNetworks();
+	if (hasSizes<SmallNetwork>(transformerSize, hidden1Size, hidden2Size))
+		architecture = Architecture::SMALL;
+	else if (hasSizes<DefaultNetwork>(transformerSize, hidden1Size, hidden2Size))
+		architecture = Architecture::DEFAULT;
+	else if (hasSizes<LargeNetwork>(transformerSize, hidden1Size, hidden2Size))
+		architecture = Architecture::LARGE;
+	else
+		return false;
 
-			bitboard pieces = Board::bb.getBitboard(piece | color);
-			Bitloop(pieces) {
-				pieceSquare = getSquare(pieces);
+	withNetwork([&](auto& net) { quantize(net, layerParameters); });
+	return true;
+}
 
-				// Side to move perspective
-				unsigned int halfKPindex = getHalfKPindex(Board::gameState.currentPlayer, piece, color, pieceSquare, kingSTM);
-				words[int(halfKPindex / 64)] |= (1ull << halfKPindex % 64);
-				unsigned int halfPieceIndex = getHalfPieceIndex(Board::gameState.currentPlayer, pieceSquare, piece, color == Board::gameState.currentPlayer);
-				words[int(halfPieceIndex / 64)] |= (1ull << halfPieceIndex % 64);
+template <typename Net>
+void NNUE::quantize(Net& net, const double* const layerParameters[4]) {
+	net.allocate();
+	clippedParameters = quantizeFeatureTransformer(net.L1, layerParameters[0]);
+	// The hidden layers get activations scaled by QA
+	clippedParameters += quantizeLayer(net.L2, layerParameters[1], QB, QA * QB);
+	clippedParameters += quantizeLayer(net.L3, layerParameters[2], QB, QA * QB);
+	clippedParameters += quantizeLayer(net.L4, layerParameters[3], QO, QA * QO);
+}
 
-				// Not side to move perspective
-				short notSTM = Piece::getOppositeColor(Board::gameState.currentPlayer);
-				halfKPindex = 41600 + getHalfKPindex(notSTM, piece, color, pieceSquare, kingNotSTM);
-				words[int(halfKPindex / 64)] |= (1ull << halfKPindex % 64);
-				halfPieceIndex = 41600 + getHalfPieceIndex(notSTM, pieceSquare, piece, color == notSTM);
-				words[int(halfPieceIndex / 64)] |= (1ull << halfPieceIndex % 64);
-			}
+template <typename Layer>
+unsigned int NNUE::quantizeLayer(Layer& layer, const double* parameters, int weightScale, int biasScale) {
+	typedef typename std::remove_reference<decltype(layer.weight(0, 0))>::type WeightType;
+	typedef typename std::remove_reference<decltype(layer.biases[0])>::type BiasType;
+
+	unsigned int clipped = 0;
+	for (int i = 0; i < layer.in_size; i++) {
+		for (int j = 0; j < layer.out_size; j++) {
+			layer.weight(i, j) = quantizeValue<WeightType>(parameters[layer.out_size * i + j], weightScale, clipped);
 		}
 	}
+	for (int i = 0; i < layer.out_size; i++) {
+		layer.biases[i] = quantizeValue<BiasType>(parameters[layer.in_size * layer.out_size + i], biasScale, clipped);
+	}
+	return clipped;
+}
 
-	// Write the words into the coordinate list
-	for (int i = 0; i < (2 * N) / 64; i++) {
-		unsigned long long wordValue = words[i];
-		if (wordValue == 0ull)
-			continue;
-		cl += std::to_string(row) + ' ' + std::to_string(i) + ' ' + std::to_string(words[i]) + '\n';
-	}
-	delete[] words;
-	
-	return cl;
-}
-
-void NNUE::loadModel(std::string path) {
-	mlpack::ann::FFN<> model;
-	mlpack::data::Load(path, "model", model);
-	
-	// L1
-	arma::mat parameters;
-	boost::apply_visitor(mlpack::ann::ParametersVisitor(parameters), model.Model()[0]);
-	// Get the weights (first part of parameters)
-	for (int i = 0; i < L1.in_size; i++) {
-		for (int j = 0; j < L1.out_size; j++) {
-			L1.weights[i][j] = parameters[L1.out_size * i + j];
+template <typename Layer>
+unsigned int NNUE::quantizeFeatureTransformer(Layer& layer, const double* parameters) {
+	const int transformerSize = Layer::out_size;
+	unsigned int clipped = 0;
+	for (int p = 0; p < N / 65; p++) {
+		// The virtual HalfPiece feature is active whenever one of its 64 HalfKP features is, so its row is added to theirs
+		const int halfPieceRow = 65 * p;
+		for (int king = 0; king < 64; king++) {
+			const int halfKProw = halfPieceRow + king + 1;
+			for (int j = 0; j < transformerSize; j++) {
+				layer.weight(64 * p + king, j) = quantizeValue<int16_t>(parameters[transformerSize * halfKProw + j] + parameters[transformerSize * halfPieceRow + j], QL1, clipped);
+			}
 		}
-
 	}
 	// Get the biases (stored last in parameters)
-	for (int i = 0; i < L1.out_size; i++) {
-		L1.biases[i] = parameters[L1.in_size * L1.out_size + i];
+	for (int j = 0; j < transformerSize; j++) {
+		layer.biases[j] = quantizeValue<int16_t>(parameters[N * transformerSize + j], QL1, clipped);
 	}
+	return clipped;
+}
 
-	// L2
-	boost::apply_visitor(mlpack::ann::ParametersVisitor(parameters), model.Model()[2]);
-	for (int i = 0; i < L2.in_size; i++) {
-		for (int j = 0; j < L2.out_size; j++) {
-			L2.weights[i][j] = parameters[L2.out_size * i + j];
-		}
+// Appends a block to the payload of a network file and pads it to the start of the next one
+static void appendBlock(std::vector<char>& payload, const void* data, size_t size) {
+	payload.insert(payload.end(), (const char*)data, (const char*)data + size);
+	payload.resize((payload.size() + NetworkFile::BLOCK_ALIGNMENT - 1) / NetworkFile::BLOCK_ALIGNMENT * NetworkFile::BLOCK_ALIGNMENT, 0);
+}
+
+// Describes the layer in the header and appends its weights and biases as they are in memory
+template <typename Layer>
+static void writeLayer(std::vector<char>& payload, NetworkFile::LayerInfo& info, const Layer& layer) {
+	info.inputs = layer.in_size;
+	info.outputs = layer.out_size;
+	info.weightSize = sizeof(layer.weights[0]);
+	info.biasSize = sizeof(layer.biases[0]);
+	info.weightsOffset = NetworkFile::payloadOffset() + payload.size();
+	appendBlock(payload, layer.weights.data(), layer.weights.size() * info.weightSize);
+	info.biasesOffset = NetworkFile::payloadOffset() + payload.size();
+	appendBlock(payload, layer.biases.data(), layer.biases.size() * info.biasSize);
+}
+
+// Checks that a block lies within the file and starts aligned
+static bool validBlock(const MappedFile& file, uint64_t offset, size_t size) {
+	return offset % NetworkFile::BLOCK_ALIGNMENT == 0 && offset <= file.size() && size <= file.size() - offset;
+}
+
+// Checks that the file's layer has the same shape and types and that its blocks lie within the file
+template <typename Layer>
+static bool layerMatches(const MappedFile& file, const NetworkFile::LayerInfo& info, const Layer& layer) {
+	if (info.inputs != (uint32_t)Layer::in_size || info.outputs != (uint32_t)Layer::out_size
+		|| info.weightSize != sizeof(layer.weights[0]) || info.biasSize != sizeof(layer.biases[0]))
+		return false;
+	return validBlock(file, info.weightsOffset, (size_t)Layer::in_size * Layer::out_size * sizeof(layer.weights[0]))
+		&& validBlock(file, info.biasesOffset, (size_t)Layer::out_size * sizeof(layer.biases[0]));
+}
+
+// Checks all layers of the file against the layers of the given architecture
+template <typename Net>
+static bool networkMatches(const MappedFile& file, const NetworkFile::Header& header, const Net& net) {
+	return layerMatches(file, header.layers[0], net.L1) && layerMatches(file, header.layers[1], net.L2)
+		&& layerMatches(file, header.layers[2], net.L3) && layerMatches(file, header.layers[3], net.L4);
+}
+
+// Points the layer to its blocks in the mapping. The mapping is page aligned, so the blocks keep their alignment
+template <typename Layer>
+static void mapLayer(const MappedFile& file, const NetworkFile::LayerInfo& info, Layer& layer) {
+	typedef typename std::remove_reference<decltype(layer.weights[0])>::type WeightType;
+	typedef typename std::remove_reference<decltype(layer.biases[0])>::type BiasType;
+	layer.weights = AlignedBuffer<WeightType>::view((const WeightType*)(file.data() + info.weightsOffset), (size_t)Layer::in_size * Layer::out_size);
+	layer.biases = AlignedBuffer<BiasType>::view((const BiasType*)(file.data() + info.biasesOffset), Layer::out_size);
+}
+
+// Writes the header and the layers of the given architecture
+template <typename Net>
+static bool writeNetwork(const Net& net, const std::string& path) {
+	NetworkFile::Header header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, NetworkFile::MAGIC, sizeof(header.magic));
+	header.version = NetworkFile::VERSION;
+	header.layerCount = 4;
+	header.activationScale = QA;
+	header.hiddenWeightScale = QB;
+	header.outputWeightScale = QO;
+	header.transformerScale = QL1;
+
+	std::vector<char> payload;
+	writeLayer(payload, header.layers[0], net.L1);
+	writeLayer(payload, header.layers[1], net.L2);
+	writeLayer(payload, header.layers[2], net.L3);
+	writeLayer(payload, header.layers[3], net.L4);
+	header.payloadSize = payload.size();
+	header.checksum = NetworkFile::checksum(payload.data(), payload.size());
+
+	// Running engines may have mapped the target, so the network is written next to it and moved over it when complete
+	const std::string tempPath = path + ".tmp";
+	std::ofstream file(tempPath, std::ios::binary);
+	file.write((const char*)&header, sizeof(header));
+	const std::vector<char> padding(NetworkFile::payloadOffset() - sizeof(header), 0);
+	file.write(padding.data(), padding.size());
+	file.write(payload.data(), payload.size());
+	file.close();
+	if (!file.good() || !MappedFile::replace(tempPath, path)) {
+		std::remove(tempPath.c_str());
+		return false;
 	}
-	// Get the biases (stored last in parameters)
-	for (int i = 0; i < L2.out_size; i++) {
-		L2.biases[i] = parameters[L2.in_size * L2.out_size + i];
+	return true;
+}
+
+bool NNUE::save(std::string path) {
+	bool saved = false;
+	withNetwork([&](const auto& net) { saved = writeNetwork(net, path); });
+	return saved;
+}
+
+bool NNUE::load(std::string path) {
+	MappedFile file;
+	if (!file.open(path) || file.size() < NetworkFile::payloadOffset()) {
+		DEBUG_CERR(path + " can't be mapped or is too short\n");
+		return false;
 	}
 
-	// L3
-	boost::apply_visitor(mlpack::ann::ParametersVisitor(parameters), model.Model()[4]);
-	for (int i = 0; i < L3.in_size; i++) {
-		for (int j = 0; j < L3.out_size; j++) {
-			L3.weights[i][j] = parameters[L3.out_size * i + j];
-		}
-	}// Get the biases (stored last in parameters)
-	for (int i = 0; i < L3.out_size; i++) {
-		L3.biases[i] = parameters[L3.in_size * L3.out_size + i];
+	NetworkFile::Header header;
+	std::memcpy(&header, file.data(), sizeof(header));
+	if (std::memcmp(header.magic, NetworkFile::MAGIC, sizeof(header.magic)) != 0 || header.version != NetworkFile::VERSION) {
+		DEBUG_CERR(path + " is no network file of version " + std::to_string(NetworkFile::VERSION) + '\n');
+		return false;
+	}
+	// The shifts and clamps of the forward pass rely on the scales
+	if (header.layerCount != 4 || header.activationScale != QA || header.hiddenWeightScale != QB || header.outputWeightScale != QO
+		|| header.transformerScale != QL1) {
+		DEBUG_CERR(path + " has a different number of layers or quantisation scales\n");
+		return false;
+	}
+	const char* payload = file.data() + NetworkFile::payloadOffset();
+	if (header.payloadSize != file.size() - NetworkFile::payloadOffset() || header.payloadSize % 8 != 0
+		|| NetworkFile::checksum(payload, header.payloadSize) != header.checksum) {
+		DEBUG_CERR(path + " is truncated or corrupted\n");
+		return false;
 	}
 
-	// L4
-	boost::apply_visitor(mlpack::ann::ParametersVisitor(parameters), model.Model()[6]);
-	for (int i = 0; i < L4.in_size; i++) {
-		L4.weights[i][0] = parameters[i];
+	// The layer shapes select the architecture
+	Architecture loaded;
+	if (networkMatches(file, header, smallNetwork))
+		loaded = Architecture::SMALL;
+	else if (networkMatches(file, header, defaultNetwork))
+		loaded = Architecture::DEFAULT;
+	else if (networkMatches(file, header, largeNetwork))
+		loaded = Architecture::LARGE;
+	else {
+		DEBUG_CERR(path + " has layer shapes of no compiled in architecture\n");
+		return false;
 	}
-	L4.biases[0] = parameters[L4.in_size];
+
+	releaseNetworks();
+	architecture = loaded;
+	withNetwork([&](auto& net) {
+		mapLayer(file, header.layers[0], net.L1);
+		mapLayer(file, header.layers[1], net.L2);
+		mapLayer(file, header.layers[2], net.L3);
+		mapLayer(file, header.layers[3], net.L4);
+	});
+	// Moving the mapping keeps its address, so the views stay valid
+	network = std::move(file);
+	return true;
 }
 
 void NNUE::printHalfKPindeces() {
@@ -440,16 +577,83 @@ void NNUE::printHalfKPindeces() {
 }
 
 template<int inputSize, int outputSize>
-inline void NNUE::linear(const Linear<inputSize, outputSize>& layer, const float* input, float* output) {
+inline void NNUE::linear(const DenseLayer<int8_t, inputSize, outputSize>& layer, const uint8_t* input, uint8_t* output) {
+	// Collect the groups of 4 inputs that contain at least one activation, branchless since about half of them do
+	int groups[inputSize / 4];
+	int groupCount = 0;
+	for (int g = 0; g < inputSize / 4; g++) {
+		uint32_t bytes;
+		std::memcpy(&bytes, input + 4 * g, 4);
+		groups[groupCount] = g;
+		groupCount += bytes != 0;
+	}
+
+#if defined(NNUE_AVX2) || defined(NNUE_SSE2)
+	const int REGISTERS = outputSize / DENSE_LANES;
+	static_assert(outputSize % (4 * DENSE_LANES) == 0, "Outputs are packed from 4 registers at once");
+
 	// "Add" Biases
-	for (int i = 0; i < outputSize; i++) {
-		output[i] = layer.biases[i];
+	vec_t sums[REGISTERS];
+	for (int r = 0; r < REGISTERS; r++) {
+		sums[r] = vecLoadBytes(layer.biases.data() + r * DENSE_LANES);
+	}
+
+	// Multiply each group with the weights of all outputs, which are stored right after another
+	for (int k = 0; k < groupCount; k++) {
+		int32_t bytes;
+		std::memcpy(&bytes, input + 4 * groups[k], 4);
+#if defined(NNUE_AVX2)
+		const vec_t group = _mm256_set1_epi32(bytes);
+#else
+		const vec_t group = _mm_set1_epi32(bytes);
+#endif
+		const int8_t* weights = layer.weights.data() + groups[k] * outputSize * 4;
+		for (int r = 0; r < REGISTERS; r++) {
+			sums[r] = vecDotAdd(sums[r], group, vecLoadBytes(weights + r * DENSE_LANES * 4));
+		}
 	}
 
-	// Vector-matrix multiplication: input[1xA] * weights[AxB] = output[1xB]
-	for (int i = 0; i < inputSize; i++) {
+	// Scale back from QA * QB to QA (rounded) and clip between 0 and 1 while packing 4 registers of int32 into bytes
+	for (int r = 0; r < REGISTERS; r += 4) {
+#if defined(NNUE_AVX2)
+		const vec_t half = _mm256_set1_epi32(QB / 2);
+		vec_t scaled[4];
+		for (int i = 0; i < 4; i++) {
+			scaled[i] = _mm256_srai_epi32(_mm256_add_epi32(sums[r + i], half), QB_SHIFT);
+		}
+		vec_t packed = _mm256_packus_epi16(_mm256_packs_epi32(scaled[0], scaled[1]), _mm256_packs_epi32(scaled[2], scaled[3]));
+		// Packing works within 128 bit lanes, restore the order of the 32 bit blocks
+		packed = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+		vecStoreBytes(output + r * DENSE_LANES, _mm256_min_epu8(packed, _mm256_set1_epi8(QA)));
+#else
+		const vec_t half = _mm_set1_epi32(QB / 2);
+		vec_t scaled[4];
+		for (int i = 0; i < 4; i++) {
+			scaled[i] = _mm_srai_epi32(_mm_add_epi32(sums[r + i], half), QB_SHIFT);
+		}
+		vec_t packed = _mm_packus_epi16(_mm_packs_epi32(scaled[0], scaled[1]), _mm_packs_epi32(scaled[2], scaled[3]));
+		vecStoreBytes(output + r * DENSE_LANES, _mm_min_epu8(packed, _mm_set1_epi8(QA)));
+#endif
+	}
+#else
+	int32_t sums[outputSize];
+	// "Add" Biases
+	for (int j = 0; j < outputSize; j++) {
+		sums[j] = layer.biases[j];
+	}
+
+	for (int k = 0; k < groupCount; k++) {
+		const uint8_t* group = input + 4 * groups[k];
+		const int8_t* weights = layer.weights.data() + groups[k] * outputSize * 4;
 		for (int j = 0; j < outputSize; j++) {
-			output[j] += input[i] * layer.weights[i][j];
+			sums[j] += group[0] * weights[j * 4] + group[1] * weights[j * 4 + 1]
+				+ group[2] * weights[j * 4 + 2] + group[3] * weights[j * 4 + 3];
 		}
 	}
-}
+
+	// Scale back from QA * QB to QA (rounded) and clip between 0 and 1
+	for (int j = 0; j < outputSize; j++) {
+		output[j] = (uint8_t)std::min(std::max(0, (sums[j] + QB / 2) >> QB_SHIFT), QA);
+	}
+#endif
+}
\ No newline at end of file
@@ -1,194 +1,319 @@
 #pragma once
-#include <direct.h>
+#include <cstdint>
+#include <string>
 #include <vector>
-#include <mlpack/core.hpp>
-#include <mlpack/methods/ann/ffn.hpp>
-#include <mlpack/methods/ann/loss_functions/mean_squared_error.hpp>
-#include <ensmallen_bits/gradient_descent/gradient_descent.hpp>
-#include "LinearBitSplit.hpp"
-#include "ClippedReLU.h"
+#include "AlignedBuffer.h"
+#include "MappedFile.h"
 
 // Forward declaration for circular dependencies
 class Board;
-class PrintValidationLoss;
 
 // 2*FeatureSet[N]->M*2->K->K->1
 // 2*HalfKP[40960](+640 virtual features)->256x2->32->32->1
 const int N = 41600;
+// The inference net adds the virtual HalfPiece rows to their HalfKP rows when it's loaded, leaving 64 rows per HalfPiece feature
+const int FOLDED_N = 40960;
+// Shape of the networks NNUETrainer creates, the engine can also load the other architectures compiled into NNUE
 const int M = 256;
 const int K = 32;
+// Widest feature transformer of all compiled in architectures, the accumulators have room for it
+const int MAX_M = 512;
+
+// Quantisation scales of the inference network, a float value of 1.0 is stored as the given integer.
+// Clipped ReLU outputs use QA, so the activations are clamped to 0...QA and fit into 8 bits.
+const int QA = 127;
+// L1 weights, biases and the accumulators use a finer scale, because the rounding errors of about 30 active features add up.
+// The clipped ReLU shifts the accumulators back to QA. Accumulator values still have room up to 32767 / QL1 = 32
+const int QL1_SHIFT = 3;
+const int QL1 = QA << QL1_SHIFT;
+// Weights of the hidden layers are int8 and get summed up in int32
+const int QB = 64;
+// The output layer only has K weights, so it keeps int16 weights with a finer scale
+const int QO = 2048;
 
 class NNUE {
 private:
 
-	// Linear network layers
-	template <int inputSize, int outputSize>
+	// Linear network layers, quantised to integer weights and biases. The buffers stay empty until they are allocated or mapped
+	template <typename WeightType, typename BiasType, int inputSize, int outputSize>
 	struct Linear {
-		int in_size, out_size;
-		float** weights;
-		float* biases;
-
-		Linear() {
-			in_size = inputSize;
-			out_size = outputSize;
-			// Construct the input x output Weights matrix
-			weights = new float* [inputSize];
-			for (int i = 0; i < inputSize; i++) {
-				weights[i] = new float[outputSize];
-			}
-
-			biases = new float[outputSize];
+		static const int in_size = inputSize;
+		static const int out_size = outputSize;
+		// input x output Weights matrix, row by row in one buffer. A row of L1 is at least 256 bytes, so every row starts at a cache line
+		AlignedBuffer<WeightType> weights;
+		AlignedBuffer<BiasType> biases;
+
+		void allocate() {
+			weights = AlignedBuffer<WeightType>((size_t)inputSize * outputSize);
+			biases = AlignedBuffer<BiasType>(outputSize);
+		}
+
+		const WeightType* row(int input) const {
+			return weights.data() + (size_t)input * outputSize;
 		}
 
-		~Linear() {
-			for (int i = 0; i < inputSize; i++) {
-				delete[] weights[i];
-			}
-			delete[] weights;
-			delete[] biases;
+		WeightType& weight(int input, int output) {
+			return weights[(size_t)input * outputSize + output];
 		}
 	};
 
-	
+	// Small dense layers behind the accumulators.
+	// The weights of 4 consecutive inputs to the same output are adjacent (input / 4, output, input % 4),
+	// so one vector instruction multiplies a group of 4 input bytes with the weights of several outputs at once.
+	template <typename WeightType, int inputSize, int outputSize>
+	struct DenseLayer {
+		static const int in_size = inputSize;
+		static const int out_size = outputSize;
+		static_assert(inputSize % 4 == 0, "Inputs are processed in groups of 4");
+
+		AlignedBuffer<WeightType> weights;
+		AlignedBuffer<int32_t> biases;
 
-	Linear<N, M> L1;
-	Linear<M * 2, K> L2;
-	Linear<K, K> L3;
-	Linear<K, 1> L4;
+		void allocate() {
+			weights = AlignedBuffer<WeightType>((size_t)inputSize * outputSize);
+			biases = AlignedBuffer<int32_t>(outputSize);
+		}
 
+		WeightType& weight(int input, int output) {
+			return weights[((input / 4) * outputSize + output) * 4 + input % 4];
+		}
+	};
+
+	/// <summary>
+	/// The layers of one architecture: 2*HalfKP[40960]->transformerSize*2->hidden1Size->hidden2Size->1.
+	/// The sizes are template parameters, so the forward pass of every architecture is compiled with fixed loop bounds.
+	/// </summary>
+	template <int transformerSize, int hidden1Size, int hidden2Size>
+	struct Network {
+		static const int TRANSFORMER_SIZE = transformerSize;
+		static const int HIDDEN1_SIZE = hidden1Size;
+		static const int HIDDEN2_SIZE = hidden2Size;
+		static_assert(transformerSize <= MAX_M, "The accumulators have to fit the feature transformer");
+
+		// Feature transformer, its rows get summed up in the accumulators. Indexed by foldedIndex()
+		Linear<int16_t, int16_t, FOLDED_N, transformerSize> L1;
+		DenseLayer<int8_t, transformerSize * 2, hidden1Size> L2;
+		DenseLayer<int8_t, hidden1Size, hidden2Size> L3;
+		// The output layer has a single output, so its weights are simply in input order
+		DenseLayer<int16_t, hidden2Size, 1> L4;
+
+		void allocate() {
+			L1.allocate();
+			L2.allocate();
+			L3.allocate();
+			L4.allocate();
+		}
+	};
+
+	// Architectures compiled into the engine, a network file selects one of them by the layer shapes in its header.
+	// A small net evaluates faster for bullet games, a large one sees more for analysis
+	typedef Network<128, 32, 32> SmallNetwork;
+	typedef Network<M, K, K> DefaultNetwork;
+	typedef Network<512, 32, 32> LargeNetwork;
+
+	enum class Architecture { NONE, SMALL, DEFAULT, LARGE };
+
+	Architecture architecture;
+	SmallNetwork smallNetwork;
+	DefaultNetwork defaultNetwork;
+	LargeNetwork largeNetwork;
+
+	// Network file the layers were loaded from. Its read-only mapping is shared by every process that loads the same file,
+	// so the layers are views into it and the weights exist only once in memory, no matter how many engines run.
+	MappedFile network;
+
+	/// <summary>
+	/// Calls the given function with the network of the current architecture, which instantiates it for every architecture.
+	/// </summary>
+	template <typename Function>
+	void withNetwork(Function&& function);
+
+	/// <summary>
+	/// Affine transformation of a hidden layer followed by the clipped ReLU.
+	/// Only the groups of 4 inputs that contain a non-zero activation get multiplied,
+	/// which skips most of L2 since the clipped accumulators are mostly 0.
+	/// </summary>
+	/// <param name="input">clipped activations of the previous layer scaled by QA, 0...QA</param>
+	/// <param name="output">activations scaled by QA, clamped to 0...QA</param>
 	template <int inputSize, int outputSize>
-	void linear(const Linear<inputSize, outputSize>& layer, const float* input, float* output);
-	void crelu(int size, const float* input, float* output);
+	void linear(const DenseLayer<int8_t, inputSize, outputSize>& layer, const uint8_t* input, uint8_t* output);
+	void crelu(int size, const int16_t* input, uint8_t* output);
 
-	std::string getHalfKPcoordinateList(unsigned long long row);
+	/// <summary>
+	/// Rounds the float parameters of one mlpack layer to the integer types of the given layer.
+	/// </summary>
+	/// <param name="parameters">weights (input by input) followed by the biases, as mlpack stores them</param>
+	/// <param name="weightScale">integer value of a weight of 1.0</param>
+	/// <param name="biasScale">integer value of a bias of 1.0</param>
+	/// <returns>how many parameters had to be clipped to the range of their type</returns>
+	template <typename Layer>
+	unsigned int quantizeLayer(Layer& layer, const double* parameters, int weightScale, int biasScale);
+	template <typename Net>
+	void quantize(Net& net, const double* const layerParameters[4]);
 
-	void loadModel(std::string path);
+	/// <summary>
+	/// Quantises L1 and folds each virtual HalfPiece row into the 64 HalfKP rows of the same piece.
+	/// </summary>
+	/// <returns>how many parameters had to be clipped to the range of int16</returns>
+	template <typename Layer>
+	unsigned int quantizeFeatureTransformer(Layer& layer, const double* parameters);
 
-public:
-	using lossFunction = mlpack::ann::MeanSquaredError<>;
+	/// <summary>
+	/// Drops the layers of all architectures and unmaps the network file.
+	/// </summary>
+	void releaseNetworks();
 
+	/// <returns>the row of L1 that belongs to the given HalfKP index, skipping the virtual rows</returns>
+	static int foldedIndex(int halfKPindex) {
+		return halfKPindex - halfKPindex / 65 - 1;
+	}
+
+public:
 	/// <summary>
 	/// One class which actually holds 2 accumulators for each perspective and allows access to them.
 	/// </summary>
 	struct Accumulator {
-		// These will be the input vector of L2
-		float v[2][M];
+		// These will be the input vector of L2, scaled by QL1. Only the first transformerSize() values of each perspective are used
+		int16_t v[2][MAX_M];
 
 		/// <summary>
 		/// Access one half of the 2 accumulators by perspective.
 		/// </summary>
 		/// <param name="white">true if white's perspective's accumulator is wanted</param>
-		/// <returns>that perspective's accumulator as a floatarray</returns>
-		float* operator[](bool white) {
+		/// <returns>that perspective's accumulator as an int16 array</returns>
+		int16_t* operator[](bool white) {
+			return v[white];
+		}
+
+		const int16_t* operator[](bool white) const {
 			return v[white];
 		}
 	};
 
-	Accumulator accumulator;
-
-	// Struct that holds all the parameters for a training session started with the overloaded train() function
-	struct TrainSession {
-		const std::string trainDataPath, valDataPath;
-		// How many calls to the train() function with different data matrices
-		const int trainings;
-		// Where to start getting the trainData from the unformatted file
-		const int offset;
-		// How much data to use in one call of train() function
-		const int dataPerTraining;
-		// Of how many continuous chunks from the original data the formatted data should be made of
-		const int dataChunks;
-		// How many epochs to run at max per train() call
-		const int epochsPerTraining;
-		// How many datapoints to shift between trainings, if shift < (dataPerTraining/dataChunks) then new training will contain "known" data
-		const int shift;
-		// Amount of data in one of the <dataChunks> chunks
-		const int chunkSize;
-
-		TrainSession(int t, int o, int d, int c, int e, float s, std::string trainPath, std::string valPath)
-			: trainings(t), offset(o), dataPerTraining(d), dataChunks(c), epochsPerTraining(e),
-			shift(d / c * s), chunkSize(shift* (t - 1) + (d / c)),
-			trainDataPath(trainPath), valDataPath(valPath) {
+	/// <summary>
+	/// The pieces a single move changed, recorded without any allocation and turned into HalfKP features when the accumulator gets updated.
+	/// A promotion with capture is the worst case: the pawn leaves, the captured piece leaves and the promoted piece arrives.
+	/// </summary>
+	struct DirtyPieces {
+		static const int MAX_PIECES = 3;
+		// Square of a piece that was captured (to) or appeared by promotion (from)
+		static const short NO_SQUARE = 64;
+
+		struct DirtyPiece {
+			short piece;
+			short from;
+			short to;
+		};
+
+		int count;
+		DirtyPiece pieces[MAX_PIECES];
+
+		void add(short piece, short from, short to) {
+			pieces[count++] = { piece, from, to };
 		}
 	};
+
+	// Every square but the two kings' could be occupied in a position read from a FEN
+	static const int MAX_ACTIVE_FEATURES = 62;
+
+	// Parameters of the loaded float model that were out of range of their quantised type
+	unsigned int clippedParameters;
+
 	/// <summary>
-	/// Construct a new NNUE object (no internal model is loaded, only for training!)
+	/// Construct a new NNUE object without any parameters, they have to be set by quantize() or load().
 	/// </summary>
 	NNUE();
 	/// <summary>
-	/// Construct a new NNUE object and call loadModel().
+	/// Construct a new NNUE object and load its weights and biases.
+	/// </summary>
+	/// <param name="networkPath">path to a .nnue network file written by save()</param>
+	NNUE(std::string networkPath);
+	/// <summary>
+	/// Quantises the float parameters of a trained model, which are stored per layer as weights (input by input) followed by the biases.
+	/// The number of parameters that didn't fit their integer type is stored in clippedParameters.
+	/// </summary>
+	/// <param name="layerParameters">of L1 (including the virtual HalfPiece rows), L2, L3 and L4</param>
+	/// <param name="transformerSize">outputs of L1, the layer sizes select the architecture</param>
+	/// <param name="hidden1Size">outputs of L2</param>
+	/// <param name="hidden2Size">outputs of L3</param>
+	/// <returns>wether one of the compiled in architectures has the given layer sizes</returns>
+	bool quantize(const double* const layerParameters[4], int transformerSize, int hidden1Size, int hidden2Size);
+	/// <summary>
+	/// Writes the quantised weights and biases to a .nnue network file (see NetworkFile.h).
 	/// </summary>
-	/// <param name="modelPath">path to a trained model to copy the weights and biases from.</param>
-	NNUE(std::string modelPath);
+	/// <returns>wether the file could be written</returns>
+	bool save(std::string path);
 	/// <summary>
-	/// Evaluate the position stored in the current accumulators by performing the forward pass through the network.
+	/// Maps a .nnue network file and uses its weights and biases in place, after checking its version, layer shapes, scales and checksum.
+	/// The file stays mapped until another network is loaded or quantised.
 	/// </summary>
+	/// <returns>wether the file is a valid network of one of the compiled in architectures</returns>
+	bool load(std::string path);
+	/// <returns>the number of accumulator values per perspective the current architecture uses, 0 without a network</returns>
+	int transformerSize() const;
+	/// <returns>wether a network was loaded or quantised, evaluate() only works then</returns>
+	bool isLoaded() const {
+		return architecture != Architecture::NONE;
+	}
+	/// <summary>
+	/// Evaluate the position stored in the given accumulators by performing the forward pass through the network.
+	/// </summary>
+	/// <param name="accumulator">of the position, both perspectives have to be up to date</param>
 	/// <param name="whiteToMove">sorts the accumulators in the right order (stm first)</param>
 	/// <returns>value between 0.0 and 1.0, indicating wether stm is losing or winning</returns>
-	float evaluate(bool whiteToMove);
-	/// <summary>
-	/// Trains a NNUE with the given parameters on a specific formatted dataset.
-	/// </summary>
-	/// <param name="newNet">wether to create a new or load an existing net</param>
-	/// <param name="modelPath">directory where the network is loaded from or where it will be created</param>
-	/// <param name="dataPath">path to a .csv file containing a training data matrix formatted by formatDataset()</param>
-	/// <param name="valPath">path to a .csv file containing a validation data matrix formatted by formatDataset()</param>
-	/// <param name="stepSize">for the gradient descent step</param>
-	/// <param name="batchSize">size of each mini-batch which make up one epoch</param>
-	/// <param name="maxIterations">after which the training is stopped</param>
-	/// <param name="predictPath">optional path to a folder to save the predictions created by cref="ValidationLoss" callback to</param>
-	void train(bool newNet, std::string modelPath, std::string dataPath, std::string valPath, double stepSize, int batchSize, int maxIterations, std::string predictPath = "");
-	/// <summary>
-	/// Trains a NNUE with the given parameters on a specific unformatted dataset for a session of multiple train()-calls.
-	/// </summary>
-	/// <param name="newNet">wether to create a new or load an existing net</param>
-	/// <param name="modelPath">directory where the network is loaded from or where it will be created</param>
-	/// <param name="stepSize">for the gradient descent step</param>
-	/// <param name="batchSize">size of each mini-batch which make up one epoch</param>
-	/// <param name="sessionInfo">struct containing all the session parameters</param>
-	void train(bool newNet, std::string modelPath, double stepSize, int batchSize, const TrainSession& sessionInfo);
-	/// <summary>
-	/// Formats a (fen,centipawn) dataset to a (halfKP,stmEval) sparse matrix to be used in training.
-	/// </summary>
-	/// <param name="inPath">path to a .csv file containing the (fen,centipawn) evaluations, line by line</param>
-	/// <param name="outPath">path and name of the .csv file that will be created. Matrix is saved in arma::coord_ascii format</param>
-	/// <param name="from">which line to start formatting</param>
-	/// <param name="to">which line to format (exclusive)</param>
-	void formatDataset(std::string inPath, std::string outPath, int from, int to);
-	/// <summary>
-	/// Makes the network predict on a given dataset, compare predictions and labels, and save the results.
-	/// </summary>
-	/// <param name="modelPath">directory where the network is loaded from</param>
-	/// <param name="testdataPath">path to the formatted data to feed through the network</param>
-	/// <param name="outName">optional name of the output file</param>
-	void predictTest(std::string modelPath, std::string testdataPath = "C:\\Users\\simon\\Documents\\Hochschule\\Schachengine\\TrainingSets\\validation_rdm_upper500k.csv",
-		std::string outName = "\\predictions.csv");
+	float evaluate(const Accumulator& accumulator, bool whiteToMove);
 	/// <param name="square">the piece is on</param>
 	/// <param name="pieceType">from Pawn (2) to Queen (6)</param>
 	/// <param name="our"> piece (1) or theirs (0)</param>
 	/// <returns>the HalfPiece Index between 0 and 41.535, calculated by: 65 * (10 * square + 5 * our + pieceType - 2)</returns>
-	unsigned int getHalfPieceIndex(short perspective, short square, short pieceType, short our);
+	static unsigned int getHalfPieceIndex(short perspective, short square, short pieceType, short our);
 	/// <param name="perspective">of the position, black's perspective get's flipped</param>
 	/// <param name="pieceType">from Pawn (2) to Queen (6)</param>
 	/// <param name="pieceColor">to check if it's "our" piece</param>
 	/// <param name="square">of the piece (0...63)</param>
 	/// <param name="kingSquare">to construct the index relative to the kingPos</param>
 	/// <returns>the HalfKP Index between 0 and 41.599, calculated by halfPieceIndex + <paramref name="kingSquare"/> + 1</returns>
-	unsigned int getHalfKPindex(short perspective, short pieceType, short pieceColor, short square, short kingSquare);
+	static unsigned int getHalfKPindex(short perspective, short pieceType, short pieceColor, short square, short kingSquare);
 	/// <summary>
 	/// Recalculates a single accumulator from scratch for the given side.
 	/// </summary>
-	/// <param name="activeFeatures">list of the indeces of all active (1) HalfKP features</param>
+	/// <param name="accumulator">whose perspective half gets overwritten</param>
+	/// <param name="activeFeatures">indeces of all active (1) HalfKP features</param>
+	/// <param name="activeCount">number of active features</param>
 	/// <param name="white">true if it's whites perspective/accumulator</param>
-	void recalculateAccumulator(const std::vector<int>& activeFeatures, bool white);
+	void recalculateAccumulator(Accumulator& accumulator, const int* activeFeatures, int activeCount, bool white);
 	/// <summary>
-	/// Updates one of the accumulators incrementally.
+	/// Updates one of the accumulators incrementally, starting from the accumulator of the previous position.
 	/// </summary>
-	/// <param name="removedFeatures">list of the indeces of all HalfKP features to be removed</param>
-	/// <param name="addedFeatures">list of the indeces of all HalfKP features to be added</param>
+	/// <param name="previous">accumulator the features were changed relative to, may be the same as <paramref name="accumulator"/></param>
+	/// <param name="accumulator">whose perspective half receives the result</param>
+	/// <param name="removedFeatures">indeces of all HalfKP features to be removed</param>
+	/// <param name="removedCount">number of removed features</param>
+	/// <param name="addedFeatures">indeces of all HalfKP features to be added</param>
+	/// <param name="addedCount">number of added features</param>
 	/// <param name="white">true if it's whites perspective/accumulator</param>
-	void updateAccumulator(const std::vector<int>& removedFeatures, const std::vector<int>& addedFeatures, bool white);
+	void updateAccumulator(const Accumulator& previous, Accumulator& accumulator, const int* removedFeatures, int removedCount, const int* addedFeatures, int addedCount, bool white);
+	/// <summary>
+	/// Updates one of the accumulators incrementally with the pieces changed by a move. Kings are no features and get skipped,
+	/// so the perspective's own king must not have moved.
+	/// </summary>
+	/// <param name="previous">accumulator before the move, may be the same as <paramref name="accumulator"/></param>
+	/// <param name="accumulator">whose perspective half receives the result</param>
+	/// <param name="dirtyPieces">changed by the move</param>
+	/// <param name="white">true if it's whites perspective/accumulator</param>
+	/// <param name="kingSquare">of the perspective's king</param>
+	void updateAccumulator(const Accumulator& previous, Accumulator& accumulator, const DirtyPieces& dirtyPieces, bool white, short kingSquare);
 	/// <summary>
 	/// Prints a list of all halfPiece and halfKP combinations and their resulting indeces.
 	/// </summary>
 	void printHalfKPindeces();
+
+private:
+	template <typename Net>
+	void recalculateAccumulator(const Net& net, Accumulator& accumulator, const int* activeFeatures, int activeCount, bool white);
+	template <typename Net>
+	void updateAccumulator(const Net& net, const Accumulator& previous, Accumulator& accumulator, const int* removedFeatures, int removedCount,
+		const int* addedFeatures, int addedCount, bool white);
+	template <typename Net>
+	float evaluate(const Net& net, const Accumulator& accumulator, bool whiteToMove);
 };
\ No newline at end of file
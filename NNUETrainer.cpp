@@ -0,0 +1,296 @@
+#include "NNUETrainer.h"
+#include "ValidationLoss.hpp"
+#include "Board.h"
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+void NNUETrainer::train(bool newNet, std::string modelPath, std::string dataPath, std::string valPath, double stepSize, int batchSize, int maxIterations, std::string predPath) {
+	arma::sp_mat sparseMatrix;
+	sparseMatrix.load(dataPath, arma::coord_ascii);
+	arma::mat trainData = (arma::mat) sparseMatrix.t();
+	
+	// Shuffle data
+	/*srand(time(NULL));
+	for (int i = 0; i < trainData.n_cols; i++) {
+		// Swap 2 random columns
+		trainData.swap_cols(rand() % trainData.n_cols, rand() % trainData.n_cols);
+	}*/
+
+	// Cut the trainLabels from the last row of the trainingData
+	arma::mat trainLabels = trainData.submat(trainData.n_rows - 1, 0, trainData.n_rows - 1, trainData.n_cols - 1);
+	trainData = trainData.submat(0, 0, trainData.n_rows - 2, trainData.n_cols - 1);
+
+	// Load validation data
+	sparseMatrix.load(valPath, arma::coord_ascii);
+	sparseMatrix = sparseMatrix.t();
+	arma::mat validationData = (arma::mat)sparseMatrix.submat(0, 0, sparseMatrix.n_rows - 2, sparseMatrix.n_cols - 1);
+	arma::mat validationLabels = (arma::mat)sparseMatrix.submat(sparseMatrix.n_rows - 1, 0, sparseMatrix.n_rows - 1, sparseMatrix.n_cols - 1);
+
+	mlpack::ann::FFN<lossFunction> network;
+
+	if (newNet) {
+		// L1
+		network.Add<mlpack::ann::LinearBitSplit<> >(2 * N, 2 * M);
+		network.Add<mlpack::ann::ClippedReLULayer<>>();
+		// L2									 
+		network.Add<mlpack::ann::Linear<> >(2 * M, K);
+		network.Add<mlpack::ann::ClippedReLULayer<>>();
+		// L3									 
+		network.Add<mlpack::ann::Linear<> >(K, K);
+		network.Add<mlpack::ann::ClippedReLULayer<>>();
+		// L4
+		network.Add<mlpack::ann::Linear<> >(K, 1);
+	}
+	else {
+		mlpack::data::Load(modelPath + "\\net.bin", "network", network);
+		// Create backup
+		mlpack::data::Save(modelPath + "\\net_backup.bin", "network", network, false);
+	}
+	
+	// Instantiate some Optimizer (Based on SGD)
+	//ens::StandardSGD optimizer(stepSize, batchSize, maxIterations, -1);
+	//ens::SPALeRASGD<> optimizer(stepSize, batchSize, maxIterations, -1);
+	ens::Adam optimizer(stepSize, batchSize, 0.9, 0.9999999999, 1e-08, maxIterations, -1);
+
+	// Open log streams
+	std::ofstream lossOutput, valLossOutput, reportOutput, dataOutput;
+	lossOutput.open(modelPath + "\\loss.txt", std::ios_base::app);
+	valLossOutput.open(modelPath + "\\validationLoss.txt", std::ios_base::app);
+	reportOutput.open(modelPath + "\\report.txt", std::ios_base::app); 
+
+	// If there is no path specified for the predicition results, just put them in the model folder
+	if (predPath == "") predPath = modelPath;
+
+	// TRAIN THE MODEL
+	network.Train(trainData, trainLabels, optimizer,
+		/*Callbacks*/
+		ens::ProgressBar(), /*ens::Report(0.1, reportOutput, 1),*/ ens::PrintLoss(lossOutput),
+		ens::ValidationLoss(network, validationData, validationLabels, predPath, 1, valLossOutput, true, 10));
+
+	mlpack::data::Save(modelPath + "\\net.bin", "network", network, false);
+
+	lossOutput.close();
+	valLossOutput.close();
+	reportOutput.close();
+}
+
+void NNUETrainer::train(bool newNet, std::string modelPath, double stepSize, int batchSize, const TrainSession& session) {
+
+	std::cout << "Starting automized training session with:\n"
+		<< '\t' << session.dataPerTraining << " samples per training\n"
+		<< "\tSplit into " << session.dataChunks << " chunks in ranges of size " << session.chunkSize << '\n'
+		<< '\t' << session.shift << " sample shift after each training\n"
+		<< '\t' << session.epochsPerTraining << " epochs per training\n"
+		<< '\t' << session.trainings << " total trainings.\n\n";
+
+	if (newNet) {
+		// Create the required subfolders for training
+		bool check = _mkdir((modelPath + "\\trainData").c_str());
+		if (!check) {
+			std::cout << "Output directory for formatted training data created.\n";
+		}
+		else {
+			std::cout << "Failed to create directory. Aborting...\n";
+			return;
+		}
+	}
+
+	// File for saving the data boundaries
+	std::ofstream dataFile(modelPath + "\\trainData\\usedData.csv", std::ios_base::app);
+
+	for (int i = 0; i < session.trainings; i++) {
+		// Get and format the training data
+		int dataMinIndex, dataMaxIndex;
+		arma::sp_mat matrixLoader, trainData;
+
+		std::cout << "\n\nFormatting data for training #" << i + 1 << " ......... ";
+		for (int j = 0; j < session.dataChunks; j++) {
+			int from = session.offset + j * session.chunkSize + i * session.shift;
+			if (!j) dataMinIndex = from;
+			int to = session.offset + j * session.chunkSize + i * session.shift + session.dataPerTraining / session.dataChunks;
+			if (j == session.dataChunks - 1) dataMaxIndex = to;
+
+			std::string outPath = modelPath + "\\trainData\\" + std::to_string(j+1) + "_1.csv";
+			std::cout << "\nData indices: " << from << " - " << to << '\n';
+			formatDataset(session.trainDataPath, outPath, from, to);
+			std::cout << "Formatting finished.\n";
+
+			// Immediately load and concatenate the formatted matrix
+			matrixLoader.load(outPath, arma::coord_ascii);
+			trainData = arma::join_cols(trainData, matrixLoader);
+		}
+		// Save the concatenated matrix
+		trainData.save(modelPath + "\\trainData\\concat.csv", arma::coord_ascii);
+
+		// Save the data boundaries
+		dataFile << dataMinIndex << "," << dataMaxIndex << "\n";
+
+		// Create a new folder for the predictions to be saved into
+		std::string predictionsPath = modelPath + "\\predictionsFromTraining" + std::to_string(i);
+		_mkdir(predictionsPath.c_str());
+
+		// Train
+		std::cout << "Starting training #" << i + 1 << "...\n";
+		train((i == 0) && newNet, modelPath, modelPath + "\\trainData\\concat.csv", session.valDataPath, stepSize, batchSize, session.dataPerTraining * session.epochsPerTraining, predictionsPath);
+		std::cout << "\nTraining finished.\n\n";
+	}
+	dataFile.close();
+}
+
+void NNUETrainer::formatDataset(std::string inPath, std::string outPath, int from, int to) {
+	std::string line;
+	std::string fen;
+	std::ifstream input(inPath);
+	std::ofstream output(outPath);
+
+	// Create a board to help with fen reading
+	Board board;
+	// First line is header
+	std::getline(input, line);
+
+	unsigned long long row = 0;
+
+	for (int i = 0; i < from; i++) {
+		std::getline(input, line);
+	}
+
+	while (std::getline(input, line) && row < (to - from)) {
+		// label and value are comma-separated
+		fen = line.substr(0, line.find(','));
+		board.readPosFromFEN(fen);
+		//board.print();
+		std::string e = line.substr(line.find(',')+1); 
+		int evalCP;
+		float evalWDL;
+
+		// Ignore samples were there is a forced mate
+		if (e.find('#') == std::string::npos) {
+			evalCP = std::stoi(e);
+			if (!board.gameState.whiteToMove()) {
+				evalCP = -evalCP;
+			}
+			// Transform evaluation from centipawns to win/draw/loss (0/0.5/1.0)
+			evalWDL = utils::math::sigmoid(evalCP, 0, 1.0f / 410.0f);
+
+
+			// Coordinate list format for sparse matrices:
+			// <row> <column> <nonzero-value>
+			std::string coordinateList = getHalfKPcoordinateList(row);
+			// Append value
+			coordinateList += std::to_string(row) + " 1300 " + std::to_string(evalWDL) + '\n';
+
+			output << coordinateList;
+		}
+		row++;
+	}
+
+	input.close();
+	output.close();
+}
+
+void NNUETrainer::predictTest(std::string modelPath, std::string testdataPath, std::string outputName) {
+	arma::sp_mat sparseMatrix;
+	sparseMatrix.load(testdataPath, arma::coord_ascii);
+	sparseMatrix = sparseMatrix.t();
+
+	arma::mat data = (arma::mat)sparseMatrix.submat(0, 0, sparseMatrix.n_rows - 2, sparseMatrix.n_cols - 1);
+	// Get the labels from the last row of the data
+	arma::mat labels = (arma::mat)sparseMatrix.submat(sparseMatrix.n_rows - 1, 0, sparseMatrix.n_rows - 1, sparseMatrix.n_cols - 1);
+
+	arma::mat prediction;
+	mlpack::ann::FFN<lossFunction> network;
+	mlpack::data::Load(modelPath + "\\net.bin", "net", network);
+
+	// Output log
+	std::ofstream predictOut(modelPath + outputName);
+	
+	double errorSum = 0;
+
+	for (int i = 0; i < data.n_cols; i++) {
+		auto column = data.col(i);
+		network.Predict(column, prediction);
+		double pred = prediction[0];
+		double label = labels[i];
+		double error = std::abs(pred - label);
+		errorSum += error;
+		std::cout << "Prediction for #" << i << " : " << pred << " (Label: " << labels[i] << ", off by " << std::abs(pred - labels[i]) << ")\n";
+		// Write it all to the log file
+		predictOut << pred << ',' << label << ',' << error << '\n';
+	}
+	std::cout << "AVERAGE ERROR: " << errorSum / data.n_cols;
+}
+
+std::string NNUETrainer::getHalfKPcoordinateList(unsigned long long row) {
+	std::string cl;
+
+	unsigned short kingSTM = Board::gameState.whiteToMove() ? Board::whiteKingPos : Board::blackKingPos;
+	unsigned short kingNotSTM = Board::gameState.whiteToMove() ? Board::blackKingPos : Board::whiteKingPos;
+	unsigned short pieceSquare;
+
+	// Each word holds 64 features
+	unsigned long long* words = new unsigned long long[(2 * N) / 64];
+	memset(words, 0ull, sizeof(words) * ((2 * N) / 64));
+
+	for (short piece = Piece::PAWN; piece <= Piece::QUEEN; piece++) {
+		for (short color = Piece::WHITE; color <= Piece::BLACK; color+=8) {
+
+			bitboard pieces = Board::bb.getBitboard(piece | color);
+			Bitloop(pieces) {
+				pieceSquare = getSquare(pieces);
+
+				// Side to move perspective
+				unsigned int halfKPindex = NNUE::getHalfKPindex(Board::gameState.currentPlayer, piece, color, pieceSquare, kingSTM);
+				words[int(halfKPindex / 64)] |= (1ull << halfKPindex % 64);
+				unsigned int halfPieceIndex = NNUE::getHalfPieceIndex(Board::gameState.currentPlayer, pieceSquare, piece, color == Board::gameState.currentPlayer);
+				words[int(halfPieceIndex / 64)] |= (1ull << halfPieceIndex % 64);
+
+				// Not side to move perspective
+				short notSTM = Piece::getOppositeColor(Board::gameState.currentPlayer);
+				halfKPindex = 41600 + NNUE::getHalfKPindex(notSTM, piece, color, pieceSquare, kingNotSTM);
+				words[int(halfKPindex / 64)] |= (1ull << halfKPindex % 64);
+				halfPieceIndex = 41600 + NNUE::getHalfPieceIndex(notSTM, pieceSquare, piece, color == notSTM);
+				words[int(halfPieceIndex / 64)] |= (1ull << halfPieceIndex % 64);
+			}
+		}
+	}
+
+	// Write the words into the coordinate list
+	for (int i = 0; i < (2 * N) / 64; i++) {
+		unsigned long long wordValue = words[i];
+		if (wordValue == 0ull)
+			continue;
+		cl += std::to_string(row) + ' ' + std::to_string(i) + ' ' + std::to_string(words[i]) + '\n';
+	}
+	delete[] words;
+	
+	return cl;
+}
+
+bool NNUETrainer::exportNetwork(std::string modelPath, std::string networkPath, unsigned int& clippedParameters) {
+	mlpack::ann::FFN<> model;
+	mlpack::data::Load(modelPath, "model", model);
+
+	// Weights are stored first in the parameters, the biases last
+	arma::mat parameters[4];
+	for (int layer = 0; layer < 4; layer++)
+		boost::apply_visitor(mlpack::ann::ParametersVisitor(parameters[layer]), model.Model()[layer * 2]);
+
+	// The layer sizes follow from the parameter counts, each layer has (inputs + 1) * outputs parameters
+	const int transformerSize = (int)(parameters[0].n_elem / (N + 1));
+	const int hidden1Size = (int)(parameters[1].n_elem / (2 * transformerSize + 1));
+	const int hidden2Size = (int)(parameters[2].n_elem / (hidden1Size + 1));
+
+	const double* layerParameters[4] = { parameters[0].memptr(), parameters[1].memptr(), parameters[2].memptr(), parameters[3].memptr() };
+	NNUE network;
+	clippedParameters = 0;
+	if (parameters[3].n_elem != (size_t)hidden2Size + 1 || !network.quantize(layerParameters, transformerSize, hidden1Size, hidden2Size)) {
+		std::cerr << "The model's layer sizes " << transformerSize << "x2-" << hidden1Size << '-' << hidden2Size << " match no architecture of the engine\n";
+		return false;
+	}
+	clippedParameters = network.clippedParameters;
+	if (clippedParameters > 0)
+		DEBUG_CERR(std::to_string(clippedParameters) + " parameters clipped while quantising " + modelPath + '\n');
+
+	return network.save(networkPath);
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include <direct.h>
+#include <string>
+#include <mlpack/core.hpp>
+#include <mlpack/methods/ann/ffn.hpp>
+#include <mlpack/methods/ann/loss_functions/mean_squared_error.hpp>
+#include <ensmallen_bits/gradient_descent/gradient_descent.hpp>
+#include "LinearBitSplit.hpp"
+#include "ClippedReLU.h"
+#include "NNUE.h"
+
+// Training side of the NNUE: formats datasets, trains the float model with mlpack and exports it as .nnue network file.
+// This is the only part of the engine that depends on mlpack, Armadillo and Boost, the engine itself only loads the exported files.
+class NNUETrainer {
+private:
+	std::string getHalfKPcoordinateList(unsigned long long row);
+
+public:
+	using lossFunction = mlpack::ann::MeanSquaredError<>;
+
+	// Struct that holds all the parameters for a training session started with the overloaded train() function
+	struct TrainSession {
+		const std::string trainDataPath, valDataPath;
+		// How many calls to the train() function with different data matrices
+		const int trainings;
+		// Where to start getting the trainData from the unformatted file
+		const int offset;
+		// How much data to use in one call of train() function
+		const int dataPerTraining;
+		// Of how many continuous chunks from the original data the formatted data should be made of
+		const int dataChunks;
+		// How many epochs to run at max per train() call
+		const int epochsPerTraining;
+		// How many datapoints to shift between trainings, if shift < (dataPerTraining/dataChunks) then new training will contain "known" data
+		const int shift;
+		// Amount of data in one of the <dataChunks> chunks
+		const int chunkSize;
+
+		TrainSession(int t, int o, int d, int c, int e, float s, std::string trainPath, std::string valPath)
+			: trainings(t), offset(o), dataPerTraining(d), dataChunks(c), epochsPerTraining(e),
+			shift(d / c * s), chunkSize(shift* (t - 1) + (d / c)),
+			trainDataPath(trainPath), valDataPath(valPath) {
+		}
+	};
+	/// <summary>
+	/// Trains a NNUE with the given parameters on a specific formatted dataset.
+	/// </summary>
+	/// <param name="newNet">wether to create a new or load an existing net</param>
+	/// <param name="modelPath">directory where the network is loaded from or where it will be created</param>
+	/// <param name="dataPath">path to a .csv file containing a training data matrix formatted by formatDataset()</param>
+	/// <param name="valPath">path to a .csv file containing a validation data matrix formatted by formatDataset()</param>
+	/// <param name="stepSize">for the gradient descent step</param>
+	/// <param name="batchSize">size of each mini-batch which make up one epoch</param>
+	/// <param name="maxIterations">after which the training is stopped</param>
+	/// <param name="predictPath">optional path to a folder to save the predictions created by cref="ValidationLoss" callback to</param>
+	void train(bool newNet, std::string modelPath, std::string dataPath, std::string valPath, double stepSize, int batchSize, int maxIterations, std::string predictPath = "");
+	/// <summary>
+	/// Trains a NNUE with the given parameters on a specific unformatted dataset for a session of multiple train()-calls.
+	/// </summary>
+	/// <param name="newNet">wether to create a new or load an existing net</param>
+	/// <param name="modelPath">directory where the network is loaded from or where it will be created</param>
+	/// <param name="stepSize">for the gradient descent step</param>
+	/// <param name="batchSize">size of each mini-batch which make up one epoch</param>
+	/// <param name="sessionInfo">struct containing all the session parameters</param>
+	void train(bool newNet, std::string modelPath, double stepSize, int batchSize, const TrainSession& sessionInfo);
+	/// <summary>
+	/// Formats a (fen,centipawn) dataset to a (halfKP,stmEval) sparse matrix to be used in training.
+	/// </summary>
+	/// <param name="inPath">path to a .csv file containing the (fen,centipawn) evaluations, line by line</param>
+	/// <param name="outPath">path and name of the .csv file that will be created. Matrix is saved in arma::coord_ascii format</param>
+	/// <param name="from">which line to start formatting</param>
+	/// <param name="to">which line to format (exclusive)</param>
+	void formatDataset(std::string inPath, std::string outPath, int from, int to);
+	/// <summary>
+	/// Makes the network predict on a given dataset, compare predictions and labels, and save the results.
+	/// </summary>
+	/// <param name="modelPath">directory where the network is loaded from</param>
+	/// <param name="testdataPath">path to the formatted data to feed through the network</param>
+	/// <param name="outName">optional name of the output file</param>
+	void predictTest(std::string modelPath, std::string testdataPath = "C:\\Users\\simon\\Documents\\Hochschule\\Schachengine\\TrainingSets\\validation_rdm_upper500k.csv",
+		std::string outName = "\\predictions.csv");
+	/// <summary>
+	/// Loads a trained float model, quantises its parameters and writes them as .nnue network file for the engine.
+	/// </summary>
+	/// <param name="modelPath">path to the model saved by train()</param>
+	/// <param name="networkPath">path of the .nnue file to write</param>
+	/// <param name="clippedParameters">receives how many parameters were out of range of their quantised type</param>
+	/// <returns>wether the file could be written</returns>
+	bool exportNetwork(std::string modelPath, std::string networkPath, unsigned int& clippedParameters);
+};
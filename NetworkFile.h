@@ -0,0 +1,64 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Layout of the .nnue files the engine loads its network from. All values are little endian.
+// The header is followed by one block for the weights and one for the biases of every layer, in the order of the layers.
+// Each block starts at a multiple of BLOCK_ALIGNMENT bytes and holds the parameters exactly in the layout the inference code
+// uses, so a mapping of the file can be used without converting anything. A checksum over everything after the header
+// detects truncated or corrupted files.
+namespace NetworkFile {
+	const char MAGIC[8] = { 'H', 'E', 'U', 'R', 'E', 'K', 'A', 'N' };
+	// Increase whenever the meaning of the blocks changes, older files get rejected then
+	const uint32_t VERSION = 2;
+	const size_t BLOCK_ALIGNMENT = 64;
+	const int MAX_LAYERS = 4;
+
+	struct LayerInfo {
+		uint32_t inputs;
+		uint32_t outputs;
+		// Size of a single weight or bias in bytes
+		uint32_t weightSize;
+		uint32_t biasSize;
+		// Offsets of the blocks from the start of the file
+		uint64_t weightsOffset;
+		uint64_t biasesOffset;
+	};
+
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t layerCount;
+		// Quantisation scales the parameters were stored with (QA, QB, QO, QL1)
+		int32_t activationScale;
+		int32_t hiddenWeightScale;
+		int32_t outputWeightScale;
+		int32_t transformerScale;
+		// Bytes after the (aligned) header, their checksum is stored as well
+		uint64_t payloadSize;
+		uint64_t checksum;
+		LayerInfo layers[MAX_LAYERS];
+	};
+	static_assert(sizeof(Header) == 176, "The header is written as it is in memory, so it must not contain padding");
+
+	/// <returns>the size of the header, rounded up to the start of the first block</returns>
+	inline size_t payloadOffset() {
+		return (sizeof(Header) + BLOCK_ALIGNMENT - 1) / BLOCK_ALIGNMENT * BLOCK_ALIGNMENT;
+	}
+
+	/// <summary>
+	/// FNV-1a over 64 bit words, which is fast enough to check the whole file on every load.
+	/// </summary>
+	/// <param name="size">in bytes, has to be a multiple of 8</param>
+	inline uint64_t checksum(const char* data, size_t size) {
+		uint64_t hash = 14695981039346656037ull;
+		for (size_t i = 0; i < size; i += 8) {
+			uint64_t word;
+			std::memcpy(&word, data + i, 8);
+			hash ^= word;
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+}
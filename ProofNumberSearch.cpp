@@ -0,0 +1,217 @@
+#include "ProofNumberSearch.h"
+#include <algorithm>
+#include <chrono>
+#include <climits>
+
+ProofNumberSearch::ProofNumberSearch(Board& board, unsigned int mb) : board(board), nodes(0), nodeLimit(0), aborted(false), attackerColor(Piece::WHITE) {
+	setSize(mb);
+}
+
+void ProofNumberSearch::setSize(unsigned int mb) {
+	size_t entries = std::max<size_t>(BUCKET_SIZE, (size_t)mb * 1024 * 1024 / sizeof(Entry));
+	// Only whole buckets
+	entries -= entries % BUCKET_SIZE;
+	table.assign(entries, Entry());
+	table.shrink_to_fit();
+}
+
+void ProofNumberSearch::clear() {
+	std::fill(table.begin(), table.end(), Entry());
+}
+
+const ProofNumberSearch::Entry* ProofNumberSearch::probe(unsigned long long zobristKey) const {
+	const Entry* bucket = &table[(zobristKey % (table.size() / BUCKET_SIZE)) * BUCKET_SIZE];
+	for (unsigned int i = 0; i < BUCKET_SIZE; i++) {
+		if (bucket[i].zobristKey == zobristKey)
+			return &bucket[i];
+	}
+	return nullptr;
+}
+
+void ProofNumberSearch::store(unsigned long long zobristKey, unsigned int phi, unsigned int delta, unsigned int work, unsigned short distance, unsigned short bestMove, bool pathDependent) {
+	Entry* bucket = &table[(zobristKey % (table.size() / BUCKET_SIZE)) * BUCKET_SIZE];
+	Entry* replace = bucket;
+	for (unsigned int i = 0; i < BUCKET_SIZE; i++) {
+		if (bucket[i].zobristKey == zobristKey) {
+			replace = &bucket[i];
+			break;
+		}
+		if (bucket[i].work < replace->work) {
+			replace = &bucket[i];
+		}
+	}
+	replace->zobristKey = zobristKey;
+	replace->phi = phi;
+	replace->delta = delta;
+	replace->work = work;
+	replace->distance = distance;
+	replace->bestMove = bestMove;
+	replace->pathDependent = pathDependent;
+}
+
+unsigned short ProofNumberSearch::encodeMove(const Move& move) {
+	return move.startSquare | (move.targetSquare << 6) | ((move.flags & 0b111) << 12);
+}
+
+void ProofNumberSearch::multipleIterativeDeepening(unsigned int ply, unsigned int phiThreshold, unsigned int deltaThreshold) {
+	const unsigned long long zobristKey = board.getZobristKey();
+	const unsigned long long startNodes = nodes;
+	const bool attacker = (ply % 2) == 0;
+	nodes++;
+
+	// A draw only reaches the goal of the defender, and so does a lone king of the attacker.
+	// Proofs never rely on these, but a disproof may have been reached only because of the path taken
+	const bool loneKing = Board::bb.getBitboard(attackerColor) == Board::bb.getBitboard(attackerColor | Piece::KING);
+	const bool pathDraw = ply >= MAX_DEPTH || (ply > 0 && board.checkForRepetition());
+	if (loneKing || pathDraw) {
+		if (attacker) store(zobristKey, INFINITE_NUMBER, 0, 1, 0, 0, pathDraw);
+		else store(zobristKey, 0, INFINITE_NUMBER, 1, 0, 0, pathDraw);
+		return;
+	}
+
+	board.generateMoves();
+	if (board.possibleMoves.empty()) {
+		// Getting mated fails both goals, a stalemate only fails the one of the attacker
+		if (attacker || Board::bb.getAttackData(Board::gameState.currentPlayer).checkExists) store(zobristKey, INFINITE_NUMBER, 0, 1, 0, 0);
+		else store(zobristKey, 0, INFINITE_NUMBER, 1, 0, 0);
+		return;
+	}
+	// A mate on the last move before the 50 move rule still counts
+	if (ply > 0 && Board::gameState.halfMoveCount >= 100) {
+		if (attacker) store(zobristKey, INFINITE_NUMBER, 0, 1, 0, 0, true);
+		else store(zobristKey, 0, INFINITE_NUMBER, 1, 0, 0, true);
+		return;
+	}
+
+	std::vector<Move>& moves = moveLists[ply];
+	std::vector<unsigned long long>& keys = childKeys[ply];
+	moves = board.possibleMoves;
+	keys.resize(moves.size());
+	for (unsigned int i = 0; i < moves.size(); i++) {
+		board.doMove(&moves[i]);
+		keys[i] = board.getZobristKey();
+		board.undoMove(&moves[i]);
+	}
+
+	unsigned int phi, delta;
+	while (true) {
+		// The player to move needs one child that fails for the opponent, and fails itself only if all children succeed for the opponent.
+		// Children that were never searched count as one leaf each way
+		phi = INFINITE_NUMBER;
+		delta = 0;
+		unsigned int bestIndex = 0, bestPhi = 0, secondDelta = INFINITE_NUMBER;
+		for (unsigned int i = 0; i < moves.size(); i++) {
+			const Entry* child = probe(keys[i]);
+			const unsigned int childPhi = child ? child->phi : 1;
+			const unsigned int childDelta = child ? child->delta : 1;
+
+			delta = std::min(delta + childPhi, INFINITE_NUMBER);
+			if (childDelta < phi) {
+				secondDelta = phi;
+				phi = childDelta;
+				bestIndex = i;
+				bestPhi = childPhi;
+			}
+			else if (childDelta < secondDelta) {
+				secondDelta = childDelta;
+			}
+		}
+
+		if (phi >= phiThreshold || delta >= deltaThreshold || aborted) {
+			break;
+		}
+
+		// Search the most proving child until it is no longer the best one or this node reaches its thresholds
+		const unsigned int childPhiThreshold = deltaThreshold >= INFINITE_NUMBER ? INFINITE_NUMBER : deltaThreshold - delta + bestPhi;
+		const unsigned int childDeltaThreshold = std::min(phiThreshold, std::min(secondDelta, INFINITE_NUMBER - 1) + 1);
+
+		const Move move = moves[bestIndex];
+		board.doMove(&move);
+		multipleIterativeDeepening(ply + 1, childPhiThreshold, childDeltaThreshold);
+		board.undoMove(&move);
+
+		aborted = aborted || nodes >= nodeLimit || board.stopDemanded;
+	}
+
+	// Remember the move that decides the node, so the mating line can be followed later on
+	unsigned short distance = 0, bestMove = 0;
+	bool decided = false;
+	// The defender holds at this node if the attacker fails with all moves or the defender has one move that holds.
+	// That only is a real disproof, if it does not depend on a path dependent draw
+	const bool defenderHolds = attacker ? delta == 0 : phi == 0;
+	bool pathDependent = attacker ? false : defenderHolds;
+	if (phi == 0 || delta == 0) {
+		for (unsigned int i = 0; i < moves.size(); i++) {
+			const Entry* child = probe(keys[i]);
+			if (!child) continue;
+
+			if (defenderHolds) {
+				if (attacker) pathDependent = pathDependent || child->pathDependent;
+				else if (child->delta == 0 && !child->pathDependent) pathDependent = false;
+			}
+
+			// Win as fast as possible, delay a loss as long as possible
+			const bool better = phi == 0
+				? child->delta == 0 && (!decided || child->distance + 1 < distance)
+				: child->phi == 0 && (!decided || child->distance + 1 > distance);
+			if (better) {
+				decided = true;
+				distance = child->distance + 1;
+				bestMove = encodeMove(moves[i]);
+			}
+		}
+	}
+	store(zobristKey, phi, delta, (unsigned int)std::min<unsigned long long>(nodes - startNodes, UINT_MAX), distance, bestMove, pathDependent);
+}
+
+std::vector<Move> ProofNumberSearch::extractLine() {
+	std::vector<Move> line;
+	while (line.size() < MAX_DEPTH) {
+		const Entry* entry = probe(board.getZobristKey());
+		if (entry == nullptr || (entry->phi != 0 && entry->delta != 0)) {
+			break;
+		}
+
+		board.generateMoves();
+		auto move = std::find_if(board.possibleMoves.begin(), board.possibleMoves.end(),
+			[entry](const Move& m) { return encodeMove(m) == entry->bestMove; });
+		// The mate itself has no moves left
+		if (move == board.possibleMoves.end()) {
+			break;
+		}
+		line.push_back(*move);
+		board.doMove(&line.back());
+	}
+
+	for (auto move = line.rbegin(); move != line.rend(); move++) {
+		board.undoMove(&*move);
+	}
+	return line;
+}
+
+ProofNumberSearch::Result ProofNumberSearch::solve(unsigned long long nodeLimit) {
+	const auto start = std::chrono::steady_clock::now();
+	this->nodeLimit = nodeLimit;
+	attackerColor = Board::gameState.currentPlayer;
+	nodes = 0;
+	aborted = false;
+	// The stored numbers depend on which color is the attacker
+	clear();
+
+	multipleIterativeDeepening(0, INFINITE_NUMBER, INFINITE_NUMBER);
+
+	Result result;
+	const Entry* root = probe(board.getZobristKey());
+	result.mateFound = root != nullptr && root->phi == 0;
+	// A disproof that relies on a repetition, the 50 move rule or the depth limit may be wrong, so it is only reported as no mate found
+	result.disproven = root != nullptr && root->delta == 0 && !root->pathDependent;
+	if (result.mateFound) {
+		result.line = extractLine();
+	}
+	result.nodes = nodes;
+	result.time = (unsigned int)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+	// Leave the move list of the root behind, like before the search
+	board.generateMoves();
+	return result;
+}
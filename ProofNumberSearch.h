@@ -0,0 +1,114 @@
+#pragma once
+#include "Board.h"
+#include <vector>
+
+// Solves forced mates with a depth-first proof-number search (df-pn).
+// Instead of evaluating positions, each node keeps track of how many leaves still have to be proven (proof number)
+// or disproven (disproof number) to decide wether the attacker can force a mate. The search always expands the most
+// proving node, which suits long and narrow mating lines much better than alpha-beta.
+// The numbers are stored in a hash table of its own, so the transposition table of the normal search stays untouched.
+class ProofNumberSearch
+{
+public:
+	struct Result {
+		bool mateFound;
+		// Wether the attacker can't force a mate at all. If neither this nor mateFound is set, the node budget ran out
+		// or the defender only held because of a repetition, the 50 move rule or the depth limit
+		bool disproven;
+		// Mating line, starting with the move of the attacker. A forced mate, but not necessarily the shortest one
+		std::vector<Move> line;
+		unsigned long long nodes;
+		unsigned int time;
+
+		Result() : mateFound(false), disproven(false), nodes(0), time(0) {}
+	};
+
+	// Proof and disproof number of a proven or disproven node
+	static const unsigned int INFINITE_NUMBER = 100000000;
+	// Lines that run longer than this are treated as a draw
+	static const unsigned int MAX_DEPTH = 100;
+
+private:
+	// The numbers are stored from the perspective of the player to move (phi/delta notation):
+	// phi is 0 if that player reaches its goal, delta is 0 if it can't. For the attacker phi is the proof number,
+	// for the defender it is the disproof number.
+	struct Entry {
+		unsigned long long zobristKey;
+		unsigned int phi, delta;
+		// Nodes searched below this entry, cheap entries are replaced first
+		unsigned int work;
+		// Plies until the mate once the node is decided, used to extract the line
+		unsigned short distance : 15;
+		// Wether the defender only holds because of a repetition, the 50 move rule or the depth limit somewhere below.
+		// Those depend on the path to the node rather than the position, so such a result is not a real disproof
+		unsigned short pathDependent : 1;
+		// Start square, target square and promotion of the move that decided the node
+		unsigned short bestMove;
+
+		Entry() : zobristKey(0), phi(1), delta(1), work(0), distance(0), pathDependent(0), bestMove(0) {}
+	};
+
+	// Entries a key can be stored in
+	static const unsigned int BUCKET_SIZE = 4;
+
+	Board& board;
+	std::vector<Entry> table;
+
+	unsigned long long nodes;
+	unsigned long long nodeLimit;
+	bool aborted;
+	// Color of the player that tries to mate, the player to move at the root
+	short attackerColor;
+
+	// Moves and the zobrist keys of the resulting positions, indexed by ply
+	std::vector<Move> moveLists[MAX_DEPTH + 1];
+	std::vector<unsigned long long> childKeys[MAX_DEPTH + 1];
+
+	/// <summary>
+	/// Expands the current node until its phi or delta reaches the threshold (Nagai's MID function).
+	/// </summary>
+	/// <param name="ply">distance to the root, even plies are the attacker's turn.</param>
+	/// <param name="phiThreshold">at which the node has to return to its parent.</param>
+	/// <param name="deltaThreshold">at which the node has to return to its parent.</param>
+	void multipleIterativeDeepening(unsigned int ply, unsigned int phiThreshold, unsigned int deltaThreshold);
+
+	/// <summary>
+	/// Stores the numbers of the node with the given key, replacing the cheapest entry of its bucket.
+	/// </summary>
+	void store(unsigned long long zobristKey, unsigned int phi, unsigned int delta, unsigned int work, unsigned short distance, unsigned short bestMove, bool pathDependent = false);
+
+	/// <returns>the entry of the given key or nullptr, if it is not stored.</returns>
+	const Entry* probe(unsigned long long zobristKey) const;
+
+	/// <summary>
+	/// Follows the stored best moves from the current position to the mate.
+	/// </summary>
+	std::vector<Move> extractLine();
+
+	static unsigned short encodeMove(const Move& move);
+
+public:
+	/// <summary>
+	/// Creates a solver that searches the positions of the given board.
+	/// </summary>
+	/// <param name="board">to solve. It is left in the position it was given in.</param>
+	/// <param name="mb">memory cap of the hash table.</param>
+	ProofNumberSearch(Board& board, unsigned int mb = 64);
+
+	/// <summary>
+	/// Resizes the hash table to the given memory cap and clears it.
+	/// </summary>
+	void setSize(unsigned int mb);
+
+	/// <summary>
+	/// Empties the hash table, done at the start of every solve.
+	/// </summary>
+	void clear();
+
+	/// <summary>
+	/// Tries to prove that the player to move can force a mate.
+	/// Stops early if the node budget runs out or board.stopDemanded is set.
+	/// </summary>
+	/// <param name="nodeLimit">maximum number of nodes to expand.</param>
+	Result solve(unsigned long long nodeLimit);
+};
@@ -39,6 +39,8 @@ void Testing::runTest() {
 		file << ";Ergebnisse;Best Move;" << Move::toString(searchResults.bestMove) << ";\n";
 		file << ";;Evaluation (CP);" << searchResults.evaluation << ";\n";
 		file << ";;Positionen;" << searchResults.positionsSearched << ";\n";
+		file << ";;Cutoffs (erster Zug);" << searchResults.cutoffs << " (" << searchResults.firstMoveCutoffs << ");\n";
+		file << ";;Ruhesuche-Positionen;" << searchResults.quiescencePositions << ";\n";
 		string dur = to_string(duration.count() * 1000.0f);
 		dur.replace(dur.find('.'), 1, ",");
 		file << ";;Zeit in ms;" << dur << ";\n";
@@ -53,3 +55,91 @@ void Testing::runTest() {
 	file.close();  
 	cout << "All tests finished.";
 }
+
+void Testing::benchmarkEvaluation(unsigned int iterations) {
+	const string fens[4] = {
+		"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+		"r3k2r/p1ppqpb1/Bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPB1PPP/R3K2R b KQkq -",
+		"rn1qkb1r/pp2pppp/5n2/3p1b2/3P4/2N1P3/PP3PPP/R1BQKBNR w KQkq -",
+		"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1"
+	};
+	Board board;
+
+	std::chrono::duration<float> total(0);
+	// Sum up the evaluations, so the calls can't be optimized away
+	long long checksum = 0;
+
+	for (const string& fen : fens) {
+		if (!board.readPosFromFEN(fen))
+			continue;
+
+		auto start = std::chrono::high_resolution_clock::now();
+		for (unsigned int i = 0; i < iterations; i++) {
+			checksum += board.evaluateNNUE();
+		}
+		std::chrono::duration<float> duration = std::chrono::high_resolution_clock::now() - start;
+		total += duration;
+
+		cout << fen << ": " << (unsigned long long)(iterations / duration.count()) << " evaluations per second\n";
+	}
+	cout << "Average: " << (unsigned long long)(4 * iterations / total.count()) << " evaluations per second (checksum " << checksum << ")\n";
+}
+
+bool Testing::verifyAccumulators(unsigned int walks, unsigned int plies) {
+	const string fens[4] = {
+		"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+		"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+		"n1n5/PPPk4/8/8/8/8/4Kppp/5N1N b - - 0 1",
+		"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1"
+	};
+	Board board;
+
+	unsigned long long checks = 0, mismatches = 0;
+	// Moves played per kind, a kind that never came up wasn't tested
+	unsigned long long castles = 0, enPassants = 0, capturePromotions = 0, kingMoves = 0;
+
+	for (const string& fen : fens) {
+		for (unsigned int walk = 0; walk < walks; walk++) {
+			if (!board.readPosFromFEN(fen))
+				break;
+
+			std::vector<Move> line;
+			while (line.size() < plies) {
+				// Taking moves back now and then lets siblings start from entries that were only partially computed
+				if (!line.empty() && rand() % 4 == 0) {
+					board.undoMove(&line.back());
+					line.pop_back();
+				}
+				else {
+					board.generateMoves();
+					if (board.possibleMoves.empty())
+						break;
+					line.push_back(board.possibleMoves[rand() % board.possibleMoves.size()]);
+					const Move& move = line.back();
+					board.doMove(&move);
+
+					if (Piece::getType(move.piece) == Piece::KING) {
+						kingMoves++;
+						if (abs(move.targetSquare - move.startSquare) == 2) castles++;
+					}
+					if (move.isEnPassant()) enPassants++;
+					if (move.isPromotion() && Piece::getType(move.capturedPiece) != Piece::NONE) capturePromotions++;
+				}
+
+				// Not every position is checked, so the updates also have to catch up over several plies
+				if (rand() % 2 == 0) {
+					checks++;
+					if (!board.accumulatorsMatch()) {
+						mismatches++;
+						cout << "Accumulator mismatch in " << board.getFENfromPos() << '\n';
+					}
+				}
+			}
+		}
+	}
+
+	cout << checks << " positions checked, " << mismatches << " mismatches\n";
+	cout << "Moves played: " << kingMoves << " king moves, " << castles << " castles, " << enPassants << " en passant, "
+		<< capturePromotions << " promotions with capture\n";
+	return mismatches == 0;
+}
@@ -37,5 +37,21 @@ private:
 public:
 	Testing();
 	void runTest();
+
+	/// <summary>
+	/// Measures how many NNUE evaluations per second the forward pass reaches on the test positions.
+	/// The accumulators are only set up once per position, so only NNUE::evaluate and the conversion to centipawns are timed.
+	/// </summary>
+	/// <param name="iterations">evaluations per position</param>
+	static void benchmarkEvaluation(unsigned int iterations = 1000000);
+
+	/// <summary>
+	/// Plays random moves and takes them back again, and compares the lazily updated accumulators to ones calculated from scratch.
+	/// The start positions contain castling, en passant, promotions with capture and king moves, which all change the features differently.
+	/// </summary>
+	/// <param name="walks">random walks per start position</param>
+	/// <param name="plies">moves played per walk</param>
+	/// <returns>wether all accumulators matched</returns>
+	static bool verifyAccumulators(unsigned int walks = 1000, unsigned int plies = 40);
 };
 
@@ -0,0 +1,91 @@
+#include "TimeManager.h"
+#include <algorithm>
+#include <limits>
+
+float TimeManager::moveOverhead = 100.0f;
+
+TimeManager::TimeManager() : start(std::chrono::steady_clock::now()), lastBestMove(Move::NULLMOVE) {
+	initInfinite();
+}
+
+void TimeManager::init(float time, float increment, unsigned int movesToGo) {
+	pondering = false;
+	start = std::chrono::steady_clock::now();
+	adaptive = true;
+	lastBestMove = Move::NULLMOVE;
+	lastEvaluation = 0;
+	bestMoveStability = 0;
+	iterations = 0;
+
+	// Without movestogo, expect the game to last for another 40 moves
+	if (movesToGo == 0 || movesToGo > 40) movesToGo = 40;
+
+	// Never plan with time that gets lost to the GUI anyways
+	float timeLeft = std::max(1.0f, time - moveOverhead * std::min(movesToGo, 5u));
+
+	optimalTime = timeLeft / movesToGo + increment * 0.75f;
+	// Allow long thinks on unstable positions, but never risk more than a certain share of the clock
+	hardLimit = std::min(optimalTime * 4.0f, (movesToGo == 1 ? 0.9f : 0.75f) * timeLeft);
+	hardLimit = std::max(1.0f, std::min(hardLimit, time - moveOverhead));
+	optimalTime = std::min(optimalTime, hardLimit);
+	softLimit = optimalTime;
+}
+
+void TimeManager::initMoveTime(float moveTime) {
+	pondering = false;
+	start = std::chrono::steady_clock::now();
+	adaptive = false;
+	lastBestMove = Move::NULLMOVE;
+	iterations = 0;
+
+	optimalTime = std::max(1.0f, moveTime - moveOverhead);
+	softLimit = optimalTime;
+	hardLimit = optimalTime;
+}
+
+void TimeManager::initInfinite() {
+	pondering = false;
+	start = std::chrono::steady_clock::now();
+	adaptive = false;
+	lastBestMove = Move::NULLMOVE;
+	iterations = 0;
+
+	optimalTime = std::numeric_limits<float>::infinity();
+	softLimit = optimalTime;
+	hardLimit = optimalTime;
+}
+
+void TimeManager::update(const Move& bestMove, int evaluation) {
+	iterations++;
+	bestMoveStability = bestMove.sameAs(lastBestMove) ? bestMoveStability + 1 : 0;
+
+	if (adaptive && iterations > 1) {
+		// The longer the best move stays the same, the less time we need to confirm it
+		const float stabilityFactors[5] = { 2.0f, 1.3f, 1.0f, 0.8f, 0.65f };
+		float factor = stabilityFactors[std::min(bestMoveStability, 4u)];
+
+		// Invest more time if the evaluation dropped since the last iteration
+		int drop = lastEvaluation - evaluation;
+		if (drop > 20) {
+			factor *= 1.0f + std::min(drop, 100) / 100.0f;
+		}
+
+		softLimit = std::min(optimalTime * factor, hardLimit);
+	}
+
+	lastBestMove = bestMove;
+	lastEvaluation = evaluation;
+}
+
+float TimeManager::elapsed() const {
+	std::chrono::duration<float, std::milli> duration = std::chrono::steady_clock::now() - start;
+	return duration.count();
+}
+
+bool TimeManager::softLimitReached() const {
+	return !pondering && elapsed() >= softLimit;
+}
+
+bool TimeManager::hardLimitReached() const {
+	return !pondering && elapsed() >= hardLimit;
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include "Move.h"
+#include <chrono>
+#include <atomic>
+
+// Decides how much time the engine may spend on the current move.
+// A soft limit is checked between iterations of the search and adapted to the stability of the best move,
+// a hard limit is checked inside the search and aborts it immediately.
+class TimeManager
+{
+private:
+	std::chrono::time_point<std::chrono::steady_clock> start;
+
+	// Time in ms the search is expected to use, before any adjustments
+	float optimalTime;
+	// Time in ms after which no new iteration should be started
+	float softLimit;
+	// Time in ms after which the search has to be aborted
+	float hardLimit;
+
+	// Wether the limits may be adjusted during the search (not the case for fixed move times)
+	bool adaptive;
+
+	Move lastBestMove;
+	int lastEvaluation;
+	// How many iterations in a row the best move stayed the same
+	unsigned int bestMoveStability;
+	unsigned int iterations;
+
+public:
+	// Time in ms that is lost per move due to communication with the GUI
+	static float moveOverhead;
+
+	// Set while searching on the opponent's time, no limit is reached until the ponderhit clears it.
+	// The limits are already calculated for the expected position and include the time spent pondering
+	std::atomic<bool> pondering;
+
+	/// <summary>
+	/// Creates a TimeManager without any limits.
+	/// </summary>
+	TimeManager();
+
+	/// <summary>
+	/// Calculates the limits for a search with a given clock and restarts the timer.
+	/// </summary>
+	/// <param name="time">left on the clock of the side to move in ms.</param>
+	/// <param name="increment">that the side to move gets after each move in ms.</param>
+	/// <param name="movesToGo">until the next time control, 0 if the rest of the game has to be played within the time.</param>
+	void init(float time, float increment, unsigned int movesToGo);
+
+	/// <summary>
+	/// Sets both limits to a fixed time and restarts the timer.
+	/// </summary>
+	/// <param name="moveTime">in ms the search should take.</param>
+	void initMoveTime(float moveTime);
+
+	/// <summary>
+	/// Removes all limits and restarts the timer. The search will only stop when demanded.
+	/// </summary>
+	void initInfinite();
+
+	/// <summary>
+	/// Adjusts the soft limit after a finished iteration.
+	/// A changing best move or a dropping evaluation extends the time, a stable best move shortens it.
+	/// </summary>
+	/// <param name="bestMove">found by the last iteration.</param>
+	/// <param name="evaluation">of the last iteration.</param>
+	void update(const Move& bestMove, int evaluation);
+
+	/// <returns>the time in ms since the last init.</returns>
+	float elapsed() const;
+
+	/// <returns>wether there is no time left to start another iteration. Never the case while pondering.</returns>
+	bool softLimitReached() const;
+
+	/// <returns>wether the search has to be aborted. Never the case while pondering.</returns>
+	bool hardLimitReached() const;
+};
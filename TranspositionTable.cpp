@@ -1,75 +1,72 @@
 #include "TranspositionTable.h"
+#include <algorithm>
 
-std::unordered_map<unsigned long long, TableEntry> TranspositionTable::hashTable;
-unsigned long long TranspositionTable::MAX_BUCKETS;
+std::vector<TableEntry> TranspositionTable::hashTable;
 const unsigned int TranspositionTable::maxMB = 16000;
 
+TableEntry* TranspositionTable::getBucket(unsigned long long zobristKey) {
+	return &hashTable[(zobristKey % (hashTable.size() / BUCKET_SIZE)) * BUCKET_SIZE];
+}
+
 void TranspositionTable::add(unsigned long long z, Move m, int e, TableEntry::scoreType t, unsigned int d) {
-	return;
 	TableEntry entry(z, m, e, t, d);
-	unsigned long long key = z % hashTable.max_size();
+	TableEntry* bucket = getBucket(z);
 
-	/*std::cout << "Max table size in byte: "
-		<< std::to_string(hashTable.max_size()) << " * ("
-		<< std::to_string(sizeof(unsigned long long)) << " + "
-		<< std::to_string(sizeof(TableEntry)) << ") = "
-		<< std::to_string(hashTable.max_size() * (sizeof(unsigned long long) + sizeof(TableEntry))) << '\n';
-	*/
-
-	if (hashTable.size() >= MAX_BUCKETS) {
-		hashTable.clear();
+	for (unsigned int i = 0; i < BUCKET_SIZE; i++) {
+		TableEntry* currentEntry = bucket + i;
+		if (currentEntry->zobristKey == z) {
+			if (currentEntry->depth <= entry.depth ||
+				((entry.type == TableEntry::scoreType::EXACT) && (currentEntry->type != TableEntry::scoreType::EXACT))) {
+				// Replace current entry
+				*currentEntry = entry;
+			}
+			return;
+		}
 	}
 
-	if (hashTable.insert(std::make_pair(key, entry)).second) {
-		// Insertion worked
-		//DEBUG_COUT("Inserted! Transposition Table size: " + std::to_string(hashTable.size()) + ", Max size: " + std::to_string(hashTable.max_size())
-		//+ ", Bucket count: " + std::to_string(hashTable.bucket_count()) + ", Max Buckets: " + std::to_string(hashTable.max_bucket_count())
-		//+ " (Load factor " + std::to_string(hashTable.max_load_factor()) + ")\n"
-		//+ " Table size in MB: " + std::to_string(sizeof(hashTable)) + '\n');
+	if (entry.depth >= bucket[0].depth) {
+		// The deeper entry is kept, the one it replaces still gets a chance in the second entry
+		bucket[1] = bucket[0];
+		bucket[0] = entry;
 	}
 	else {
-		// Collision, do stuff...
-		//DEBUG_COUT("Insertion failed...");
-		TableEntry* currentEntry = &hashTable[key];
-
-		if (currentEntry->zobristKey != entry.zobristKey) {
-			// Different zobrist keys map to same value
-			//DEBUG_CERR("Collision!");
-			if ((t == TableEntry::scoreType::EXACT) && d >= currentEntry->depth) {
-				// Replace old entry if new one is exact and has atleast same depth
-				hashTable[key] = entry;
-			}
-		}
-
-		else if (currentEntry->depth < entry.depth ||
-			((entry.type == TableEntry::scoreType::EXACT) && (currentEntry->type != TableEntry::scoreType::EXACT))) {
-			// Replace current entry
-			*currentEntry = entry;
-			//DEBUG_COUT("Replaced!");
-		}
-		//DEBUG_COUT('\n');
+		bucket[1] = entry;
 	}
 }
 
 TableEntry* TranspositionTable::get(unsigned long long zobristKey) {
-	unsigned long long key = zobristKey % hashTable.max_size();
-	if (hashTable.count(key)) {
-		TableEntry* entry = &hashTable[key];
-		if (entry->zobristKey == zobristKey)
-			return entry;
+	TableEntry* bucket = getBucket(zobristKey);
+	for (unsigned int i = 0; i < BUCKET_SIZE; i++) {
+		if (bucket[i].zobristKey == zobristKey)
+			return bucket + i;
 	}
 	return nullptr;
 }
 
 void TranspositionTable::clear() {
-	hashTable.clear();
+	std::fill(hashTable.begin(), hashTable.end(), TableEntry());
 }
 
 void TranspositionTable::setSize(unsigned int mb) {
 	if (mb > maxMB)
 		mb = maxMB;
 
-	// Rough approximation for an upper bound of the bucket size
-	const auto BYTE_PER_ENTRY = (sizeof(TableEntry) + sizeof(unsigned long long)) * 1.5f;
-	MAX_BUCKETS = (unsigned long long)((1000000 * mb) / BYTE_PER_ENTRY);
+	size_t entries = std::max<size_t>(BUCKET_SIZE, (size_t)mb * 1024 * 1024 / sizeof(TableEntry));
+	// Only whole buckets
+	entries -= entries % BUCKET_SIZE;
+	hashTable.assign(entries, TableEntry());
+	hashTable.shrink_to_fit();
+}
+
+unsigned int TranspositionTable::hashfull() {
+	// A sample of the first entries is enough, the keys are spread evenly
+	const size_t sample = std::min<size_t>(1000, hashTable.size());
+	if (sample == 0)
+		return 0;
+	size_t used = 0;
+	for (size_t i = 0; i < sample; i++) {
+		if (hashTable[i].zobristKey != 0)
+			used++;
+	}
+	return (unsigned int)(used * 1000 / sample);
 }
@@ -2,7 +2,7 @@
 #include "Move.h"
 #include "Board.h"
 #include <iostream>
-#include <unordered_map>
+#include <vector>
 
 
 struct TableEntry {
@@ -21,10 +21,15 @@ struct TableEntry {
 	TableEntry(unsigned long long z, Move m, int e, scoreType t, unsigned int d) : zobristKey(z), bestMove(m), evaluation(e), type(t), depth(d) {}
 };
 
+// Fixed size hash table, allocated once by setSize, so adding an entry never allocates.
+// Every key maps to a bucket of two entries: the first one keeps the deepest search, the second one always takes the newest.
 class TranspositionTable {
 private:
-	static std::unordered_map<unsigned long long, TableEntry> hashTable;
-	static unsigned long long MAX_BUCKETS;
+	static std::vector<TableEntry> hashTable;
+	static const unsigned int BUCKET_SIZE = 2;
+
+	/// <returns>the first entry of the bucket the key belongs to</returns>
+	static TableEntry* getBucket(unsigned long long zobristKey);
 
 public:
 	static const unsigned int maxMB;
@@ -32,5 +37,7 @@ public:
 	static TableEntry* get(unsigned long long zobristKey);
 	static void clear();
 	static void setSize(unsigned int mb);
+	// Usage of the table in permill, as reported by UCI's hashfull
+	static unsigned int hashfull();
 };
 
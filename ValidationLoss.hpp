@@ -1,7 +1,7 @@
 #ifndef ENSMALLEN_CALLBACKS_VAL_LOSS_HPP
 #define ENSMALLEN_CALLBACKS_VAL_LOSS_HPP
 
-#include "NNUE.h"
+#include "NNUETrainer.h"
 #include <iostream>
 #include <mlpack/methods/ann/ffn.hpp>
 
@@ -20,7 +20,7 @@ namespace ens {
 
         int predictionsInterval;
 
-        mlpack::ann::FFN<NNUE::lossFunction>& network;
+        mlpack::ann::FFN<NNUETrainer::lossFunction>& network;
 
         arma::mat& validationData, validationLabels;
 
@@ -38,7 +38,7 @@ namespace ens {
          *
          * @param ostream Ostream which receives output from this object.
          */
-        ValidationLoss(mlpack::ann::FFN<NNUE::lossFunction>& net, arma::mat& valData, arma::mat& valLabels, std::string& predictionFilesPath, int savePredictionsInterval,
+        ValidationLoss(mlpack::ann::FFN<NNUETrainer::lossFunction>& net, arma::mat& valData, arma::mat& valLabels, std::string& predictionFilesPath, int savePredictionsInterval,
             std::ostream& output = arma::get_cout_stream(), bool earlyStop = false, unsigned int pat = 10)
             : network(net), output(output), validationData(valData), validationLabels(valLabels), predictionsPath(predictionFilesPath),
             predictionsInterval(savePredictionsInterval), earlyStopAtMinLoss(earlyStop), patience(pat), steps(0), bestLoss(100000.0)
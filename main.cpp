@@ -2,6 +2,15 @@
 #include "uci.h"
 #include "Testing.h"
 #include "NNUE.h"
+#include "ProofNumberSearch.h"
+
+// The project defines TRAINING=0 for a build without mlpack (msbuild /p:Training=false), which also leaves out NNUETrainer.cpp
+#ifndef TRAINING
+#define TRAINING 1
+#endif
+#if TRAINING
+#include "NNUETrainer.h"
+#endif
 
 using namespace std;
 
@@ -10,9 +19,15 @@ int main() {
 	cout << "Welcome to Heureka Engine (Version 0.3), developed by Simon Hetzer.\n";
 	cout << "Enter \"uci\" to start UCI communication (for debugging or Chess GUIs only).\n";
 	cout << "Enter \"test\" to run the current test suite.\n";
+	cout << "Enter \"bench\" to measure the evaluation speed of the NNUE.\n";
+	cout << "Enter \"verify\" to check the incremental NNUE updates against a calculation from scratch.\n";
+#if TRAINING
 	cout << "Enter \"train\" to start a training session of the NNUE.\n";
 	cout << "Enter \"format\" to format the given dataset for later use in training.\n";
 	cout << "Enter \"predict\" to predict a testdata set with the given NNUE.\n";
+	cout << "Enter \"quantize\" to convert a trained NNUE to its quantised .nnue file.\n";
+#endif
+	cout << "Enter \"solve\" to prove a forced mate in a given position.\n";
 	cout << "Press any other key to launch integrated GUI.\n";
 
 	string line;
@@ -42,8 +57,15 @@ int main() {
 		// Run Testsuite
 		Testing test;
 	}
+	else if (line == "bench") {
+		Testing::benchmarkEvaluation();
+	}
+	else if (line == "verify") {
+		Testing::verifyAccumulators();
+	}
+#if TRAINING
 	else if (line == "format") {
-		NNUE nnue;
+		NNUETrainer trainer;
 		/*
 		* FORMAT DATA BATCHES
 		* 
@@ -52,7 +74,7 @@ int main() {
 		for (int fifties = 0; fifties < 10; fifties++) {
 			for (int k = 0; k < 50; k++) {
 				string outputPath = "C:\\Users\\simon\\Documents\\Hochschule\\Schachengine\\TrainingSets\\random_evals\\" + to_string(fifties + 1) + '_' + to_string(k + 1) + ".csv";
-				nnue.formatDataset(path, outputPath, 50000 * fifties + 1000 * k, 50000 * fifties + 1000 * (k + 1));
+				trainer.formatDataset(path, outputPath, 50000 * fifties + 1000 * k, 50000 * fifties + 1000 * (k + 1));
 			}
 		}*/
 		
@@ -64,11 +86,11 @@ int main() {
 		int to = stoi(line);
 		cout << "Data path: ";
 		cin >> line;
-		nnue.formatDataset(line, line.substr(0, line.find_last_of('.'))
+		trainer.formatDataset(line, line.substr(0, line.find_last_of('.'))
 			+ "Formatted" + to_string(from) + '_' + to_string(to) + ".csv", from, to);
 	}
 	else if (line == "train") {
-		NNUE nnue;
+		NNUETrainer trainer;
 
 		cout << "Train a NEW network? (Y for yes) ";
 		cin >> line;
@@ -126,9 +148,9 @@ int main() {
 			cin >> line;
 			e = stoi(line);
 
-			NNUE::TrainSession session(t, o, d, c, e, s, dataPath, validationPath);
+			NNUETrainer::TrainSession session(t, o, d, c, e, s, dataPath, validationPath);
 
-			nnue.train(newNet, modelPath, stepSize, batchSize, session);
+			trainer.train(newNet, modelPath, stepSize, batchSize, session);
 
 			return 0;
 		}
@@ -160,10 +182,10 @@ int main() {
 			<< "Step size: " << to_string(stepSize) << ", batch size: " << to_string(batchSize) << '\n'
 			<< "Max iterations: " << to_string(maxIterations) << '\n';
 
-		nnue.train(newNet, modelPath, dataPath, validationPath, stepSize, batchSize, maxIterations);
+		trainer.train(newNet, modelPath, dataPath, validationPath, stepSize, batchSize, maxIterations);
 	}
 	else if (line == "predict") {
-		NNUE nnue;
+		NNUETrainer trainer;
 
 		string modelPath, dataPath;
 		cout << "Model path: ";
@@ -173,9 +195,56 @@ int main() {
 		cin >> dataPath;
 
 		if (dataPath != "n")
-			nnue.predictTest(modelPath, dataPath);
+			trainer.predictTest(modelPath, dataPath);
+		else
+			trainer.predictTest(modelPath);
+	}
+	else if (line == "quantize") {
+		string modelPath, outPath;
+		cout << "Model path: ";
+		cin >> modelPath;
+
+		cout << "Output path (.nnue): ";
+		cin >> outPath;
+
+		NNUETrainer trainer;
+		unsigned int clippedParameters;
+		bool saved = trainer.exportNetwork(modelPath, outPath, clippedParameters);
+		if (clippedParameters > 0)
+			cout << clippedParameters << " parameters were out of range and got clipped.\n";
+
+		if (saved)
+			cout << "Quantised network saved to " << outPath << '\n';
 		else
-			nnue.predictTest(modelPath);
+			cout << "Failed to write " << outPath << '\n';
+	}
+#endif
+	else if (line == "solve") {
+		Board board;
+		ProofNumberSearch solver(board);
+
+		cout << "FEN: ";
+		getline(cin, line);
+		if (!board.readPosFromFEN(line)) {
+			cout << "Invalid FEN.\n";
+			return 0;
+		}
+
+		cout << "Node budget: ";
+		getline(cin, line);
+		ProofNumberSearch::Result result = solver.solve(stoull(line));
+
+		if (result.mateFound) {
+			cout << "Mate in " << (result.line.size() + 1) / 2 << ":";
+			for (const Move& move : result.line) {
+				cout << ' ' << Move::toString(move);
+			}
+			cout << '\n';
+		}
+		else {
+			cout << (result.disproven ? "No mate exists.\n" : "No mate found.\n");
+		}
+		cout << "Nodes: " << result.nodes << ", time: " << result.time << " ms\n";
 	}
 	else {
 		// Constructs the gui which enters the main loop
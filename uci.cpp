@@ -1,52 +1,83 @@
 #include "uci.h"
 
-UCI::UCI() {
+UCI::UCI() : running(false), waitingForBoard(false), pondering(false), infinite(false), solving(false), solver(board) {
 	cout << "id name Heureka Engine" << endl;
 	cout << "id author SimonHetzer" << endl;
 	cout << "id version 0.2.4" << endl;
 	cout << "option name Hash type spin default 128 min 16 max " << TranspositionTable::maxMB << endl;
+	cout << "option name Ponder type check default false" << endl;
+	cout << "option name MultiPV type spin default 1 min 1 max 64" << endl;
+	cout << "option name Solver Hash type spin default 64 min 1 max " << TranspositionTable::maxMB << endl;
+	cout << "option name Move Overhead type spin default " << int(TimeManager::moveOverhead) << " min 0 max 5000" << endl;
+	cout << "option name Reverse Futility Pruning type check default true" << endl;
+	cout << "option name Futility Pruning type check default true" << endl;
+	cout << "option name Razoring type check default true" << endl;
+	cout << "option name Late Move Pruning type check default true" << endl;
+	cout << "option name EvalFile type string default " << Board::defaultNetworkPath << endl;
 	cout << "uciok" << endl;
 
 	srand(time(NULL));
 
+	board.iterationFinished = [this](const Board::SearchResults& results) {
+		string info = getInfoString(results);
+		lock_guard<mutex> lock(infoMutex);
+		searchInfo += info;
+	};
+
 	mainLoop();
 }
 
 void UCI::handleInputLoop() {
-	unsigned int d = 0, p = 0;
-	int e = 0;
-	Move* m;
-
 	while (true) {
 		ioMutex.lock();
-		if (waitingForBoard) {
-			// Print update of new searched depth
-			/*
-			d = board.currentSearch.depth;
-			p = board.currentSearch.positionsSearched;
-			e = board.currentSearch.evaluation;
-			m = &board.currentSearch.bestMove;
-
-			output += "info depth " + std::to_string(d);
-			output += " score cp " + std::to_string(e);
-			output += " pv " + Move::toString(*m);
-			output += " nodes " + std::to_string(p) + '\n';
-			*/
-
-			// Board has finished searching
-			if (searchResults._Is_ready()) {
+		if (waitingForBoard && solving) {
+			// The solver stops on its own once the node budget runs out
+			if (solveResults._Is_ready()) {
+				output += getSolveString(solveResults.get());
+				waitingForBoard = false;
+				solving = false;
+			}
+			else if (input == "stop") {
+				board.stopDemanded = true;
+				output += getSolveString(solveResults.get());
+				waitingForBoard = false;
+				solving = false;
+				input.clear();
+			}
+		}
+		else if (waitingForBoard) {
+			// Print the info of all iterations finished since the last check
+			infoMutex.lock();
+			output += searchInfo;
+			searchInfo.clear();
+			infoMutex.unlock();
+
+			// Board has finished searching (while pondering or searching infinitely, the GUI expects no bestmove before ponderhit or stop)
+			if (!pondering && !infinite && searchResults._Is_ready()) {
 				Board::SearchResults results = searchResults.get();
-				output += "bestmove " + Move::toString(results.bestMove) + "\n";
+				output += searchInfo;
+				searchInfo.clear();
+				output += getBestMoveString(results);
 				waitingForBoard = false;
 			}
 			// Protocol forces board to stop searching
 			// Use best move you found till now
-			if (input == "stop") {
+			else if (input == "stop") {
+				const auto stopTime = chrono::steady_clock::now();
 				board.stopDemanded = true;
 				// Future will be ready immediately, because stop was demanded
 				Board::SearchResults results = searchResults.get();
-				output += "bestmove " + Move::toString(results.bestMove) + "\n";
+				output += searchInfo;
+				searchInfo.clear();
+				if (pondering) {
+					// The opponent didn't play the expected move, the next go starts a new search on the real position
+					auto latency = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - stopTime);
+					output += "info string ponder miss, search stopped after " + to_string(latency.count()) + " us\n";
+					pondering = false;
+				}
+				output += getBestMoveString(results);
 				waitingForBoard = false;
+				infinite = false;
 				input.clear();
 			}
 		}
@@ -64,6 +95,14 @@ void UCI::handleInputLoop() {
 			else if (input.substr(0, 2) == "go") {
 				parseGo(input);
 			}
+			else if (input == "ponderhit") {
+				// The expected move was played, the running search goes on with the limits of the go ponder command
+				board.timeManager.pondering = false;
+				pondering = false;
+			}
+			else if (input.substr(0, 5) == "solve") {
+				parseSolve(input);
+			}
 			else if (input == "isready") {
 				// Check some things ...
 				// ....
@@ -123,7 +162,9 @@ void UCI::parsePosition(std::string input) {
 	}
 	else {
 		// Parse a FEN string
-		string fen = input.substr(input.find("fen") + 4, input.length());
+		size_t fenStart = input.find("fen") + 4;
+		size_t movesStart = input.find(" moves", fenStart);
+		string fen = input.substr(fenStart, movesStart == string::npos ? string::npos : movesStart - fenStart);
 		board.readPosFromFEN(fen);
 	}
 	int i = input.find("moves");
@@ -151,16 +192,75 @@ string UCI::getWordAfter(const string& sentence, const string& word) {
 	return sentence.substr(searchStart, searchEnd - searchStart);
 }
 
-// go wtime 300000 btime 300000 movestogo 40
+// go wtime 300000 btime 300000 winc 2000 binc 2000 movestogo 40
+// go depth 12 | go nodes 1000000 | go infinite | go movetime 1000 searchmoves e2e4 d2d4
 void UCI::parseGo(string input) {
-	float movetime = 5000.0f;
-	float wtime = 5000.0f;
-	float btime = 5000.0f;
-	unsigned int movestogo = 1;
+	// The solver works on the same board
+	if (solving) {
+		output += "info string go can't be started while solving\n";
+		return;
+	}
+	// The running search reads the limits, a new one needs a stop first
+	if (waitingForBoard) {
+		output += "info string go can't be started while searching\n";
+		return;
+	}
+	float wtime = 0.0f, btime = 0.0f, winc = 0.0f, binc = 0.0f;
+	unsigned int movestogo = 0;
+	board.searchLimits = Board::SearchLimits();
+	infinite = false;
 
-	string word = getWordAfter(input, "movetime");
+	string word = getWordAfter(input, "mate");
 	if (!word.empty()) {
-		movetime = stof(word);
+		unsigned int moves;
+		try {
+			moves = stoi(word);
+		}
+		catch (exception e) {
+			return;
+		}
+		moves = min(moves, (unsigned int)Board::MAX_MATE_MOVES);
+
+		// Only look for a forced mate, until it is found or a stop is demanded
+		board.timeManager.initInfinite();
+		board.stopDemanded = false;
+		searchResults = async(&Board::mateSearch, &board, moves);
+		waitingForBoard = true;
+		return;
+	}
+
+	word = getWordAfter(input, "depth");
+	if (!word.empty()) {
+		try {
+			board.searchLimits.depth = stoi(word);
+		}
+		catch (exception e) {
+			// Ignore the bad limit, the other ones still apply
+		}
+	}
+
+	word = getWordAfter(input, "nodes");
+	if (!word.empty()) {
+		try {
+			board.searchLimits.nodes = stoul(word);
+		}
+		catch (exception e) {
+			// Ignore the bad limit, the other ones still apply
+		}
+	}
+
+	parseSearchMoves(input);
+
+	word = getWordAfter(input, "movetime");
+	if (!word.empty()) {
+		board.timeManager.initMoveTime(stof(word));
+		goto search;
+	}
+
+	if (input.find("infinite") != string::npos) {
+		// Search until stop, even if the search itself ran out of depth
+		board.timeManager.initInfinite();
+		infinite = true;
 		goto search;
 	}
 
@@ -174,26 +274,118 @@ void UCI::parseGo(string input) {
 		btime = stof(word);
 	}
 
+	word = getWordAfter(input, "winc");
+	if (!word.empty()) {
+		winc = stof(word);
+	}
+
+	word = getWordAfter(input, "binc");
+	if (!word.empty()) {
+		binc = stof(word);
+	}
+
 	word = getWordAfter(input, "movestogo");
 	if (!word.empty()) {
 		movestogo = stoi(word);
 	}
 
-	// Calculate time for search w.r.t. collected parameters
-	movetime = Board::gameState.whiteToMove() ? wtime : btime;
-	movetime /= movestogo;
+	if (input.find("wtime") == string::npos && input.find("btime") == string::npos) {
+		if (board.searchLimits.depth > 0 || board.searchLimits.nodes > 0) {
+			// Only the given limits end the search
+			board.timeManager.initInfinite();
+		}
+		else {
+			// No limit given at all, search for ~5s
+			board.timeManager.initMoveTime(5000.0f);
+		}
+	}
+	else if (Board::gameState.whiteToMove()) {
+		board.timeManager.init(wtime, winc, movestogo);
+	}
+	else {
+		board.timeManager.init(btime, binc, movestogo);
+	}
 
 	search:
-	// Margin time
-	if (movetime > 550.0f) movetime -= 500.0f;
-
-	// Start search thread for ~4s
-	searchResults = async(&Board::iterativeSearch, board, movetime);
+	// go ponder searches the position after the expected reply, while the clock of the opponent is running
+	pondering = input.find("ponder") != string::npos;
+	board.timeManager.pondering = pondering;
+	board.stopDemanded = false;
+	searchResults = async(&Board::timedSearch, &board);
 	waitingForBoard = true;
 }
 
+// Reads the moves after searchmoves, up to the next word that is no legal move
+void UCI::parseSearchMoves(const string& input) {
+	size_t i = input.find("searchmoves");
+	if (i == string::npos) {
+		return;
+	}
+	board.generateMoves();
+	// Skip "searchmoves "
+	i += 12;
+	while (i < input.size()) {
+		size_t wordEnd = input.find(' ', i);
+		if (wordEnd == string::npos) wordEnd = input.size();
+		string move = input.substr(i, wordEnd - i);
+		auto legalMove = find_if(board.possibleMoves.begin(), board.possibleMoves.end(),
+			[&move](const Move& m) { return Move::toString(m) == move; });
+		if (legalMove == board.possibleMoves.end()) {
+			break;
+		}
+		board.searchLimits.searchMoves.push_back(*legalMove);
+		i = wordEnd + 1;
+	}
+}
+
+// info depth 12 seldepth 20 multipv 1 score cp 35 nodes 123456 nps 800000 time 154 hashfull 12 pv e2e4 e7e5 g1f3
+string UCI::getInfoString(const Board::SearchResults& results) {
+	unsigned int time = (unsigned int)board.timeManager.elapsed();
+	unsigned long long nps = (unsigned long long)results.positionsSearched * 1000 / max(1u, time);
+
+	string info = "info depth " + to_string(results.depth);
+	info += " seldepth " + to_string(results.selectiveDepth);
+	info += " multipv " + to_string(results.multiPV);
+	if (abs(results.evaluation) >= Board::MATE_BOUND) {
+		// Mate scores count plies, UCI counts moves
+		int mateIn = (Board::MATE_SCORE - abs(results.evaluation) + 1) / 2;
+		info += " score mate " + to_string(results.evaluation > 0 ? mateIn : -mateIn);
+	}
+	else {
+		info += " score cp " + to_string(results.evaluation);
+	}
+	info += " nodes " + to_string(results.positionsSearched);
+	info += " nps " + to_string(nps);
+	info += " time " + to_string(time);
+	info += " hashfull " + to_string(TranspositionTable::hashfull());
+	info += " pv";
+	for (const Move& move : results.principalVariation) {
+		info += ' ' + Move::toString(move);
+	}
+	return info + '\n';
+}
+
+// bestmove e2e4 ponder e7e5
+string UCI::getBestMoveString(const Board::SearchResults& results) {
+	string bestMove = "bestmove " + Move::toString(results.bestMove);
+	// The expected reply of the opponent is the position to ponder on
+	if (results.principalVariation.size() >= 2 && results.principalVariation[0].sameAs(results.bestMove)) {
+		bestMove += " ponder " + Move::toString(results.principalVariation[1]);
+	}
+	return bestMove + '\n';
+}
+
+string UCI::getOptionName(const string& input) {
+	size_t nameStart = input.find("name ");
+	if (nameStart == string::npos)
+		return "";
+	nameStart += 5;
+	size_t nameEnd = input.find(" value", nameStart);
+	return input.substr(nameStart, nameEnd == string::npos ? string::npos : nameEnd - nameStart);
+}
+
 void UCI::parseOption(std::string input) {
-	string optionType = getWordAfter(input, "name");
+	string optionType = getOptionName(input);
 	DEBUG_COUT("Option Name: " + optionType + '\n');
 
 	if (optionType == "Hash") {
@@ -208,4 +400,100 @@ void UCI::parseOption(std::string input) {
 		TranspositionTable::setSize(size);
 		output += "info transposition table size " + to_string(size) + " mb.\n";
 	}
+	else if (optionType == "MultiPV") {
+		string value = getWordAfter(input, "value");
+		try {
+			board.multiPV = max(1, stoi(value));
+		}
+		catch (exception e) {
+			return;
+		}
+	}
+	else if (optionType == "Solver Hash") {
+		string value = getWordAfter(input, "value");
+		try {
+			solver.setSize(stoi(value));
+		}
+		catch (exception e) {
+			return;
+		}
+	}
+	else if (optionType == "Reverse Futility Pruning") {
+		board.searchOptions.reverseFutilityPruning = getWordAfter(input, "value") == "true";
+	}
+	else if (optionType == "Futility Pruning") {
+		board.searchOptions.futilityPruning = getWordAfter(input, "value") == "true";
+	}
+	else if (optionType == "Razoring") {
+		board.searchOptions.razoring = getWordAfter(input, "value") == "true";
+	}
+	else if (optionType == "Late Move Pruning") {
+		board.searchOptions.lateMovePruning = getWordAfter(input, "value") == "true";
+	}
+	else if (optionType == "EvalFile") {
+		// The path may contain spaces, so it is everything after the value keyword
+		size_t valueStart = input.find(" value ");
+		if (valueStart == string::npos)
+			return;
+		string path = input.substr(valueStart + 7);
+		if (waitingForBoard)
+			output += "info string network can't be changed while searching\n";
+		else if (board.loadNetwork(path))
+			output += "info string network " + path + " loaded\n";
+		else
+			output += "info string failed to load network " + path + ", keeping the previous one\n";
+	}
+	else if (optionType == "Move Overhead") {
+		string value = getWordAfter(input, "value");
+		try {
+			TimeManager::moveOverhead = stof(value);
+		}
+		catch (exception e) {
+			return;
+		}
+	}
+}
+
+// solve nodes 1000000
+// Not part of UCI: proves a forced mate for the side to move with the proof-number search.
+// Runs in the background like a go, until the node budget runs out or a stop is demanded.
+void UCI::parseSolve(string input) {
+	if (waitingForBoard) {
+		output += "info string solve can't be started while searching\n";
+		return;
+	}
+
+	unsigned long long nodeLimit = 1000000;
+	string word = getWordAfter(input, "nodes");
+	if (!word.empty()) {
+		try {
+			nodeLimit = stoull(word);
+		}
+		catch (exception e) {
+			return;
+		}
+	}
+
+	board.stopDemanded = false;
+	solveResults = async(&ProofNumberSearch::solve, &solver, nodeLimit);
+	solving = true;
+	waitingForBoard = true;
+}
+
+string UCI::getSolveString(const ProofNumberSearch::Result& result) {
+	string info = "info string";
+	if (result.mateFound) {
+		info += " mate " + to_string((result.line.size() + 1) / 2);
+	}
+	else {
+		info += result.disproven ? " no mate exists" : " no mate found";
+	}
+	info += " nodes " + to_string(result.nodes) + " time " + to_string(result.time);
+	if (result.mateFound) {
+		info += " pv";
+		for (const Move& move : result.line) {
+			info += ' ' + Move::toString(move);
+		}
+	}
+	return info + '\n';
 }
@@ -2,10 +2,12 @@
 
 #include "Board.h"
 #include "TranspositionTable.h"
+#include "ProofNumberSearch.h"
 #include <iostream>
 #include <string>
 #include <time.h>
 #include <mutex>
+#include <algorithm>
 
 
 using namespace std;
@@ -16,19 +18,38 @@ private:
 	bool running;
 	Board board;
 	bool waitingForBoard;
+	// Wether the running search is a go ponder that didn't get its ponderhit yet
+	bool pondering;
+	// Wether the running search was started with go infinite and only ends with a stop
+	bool infinite;
+	// Wether the board is busy with a solve instead of a go, its result is in solveResults
+	bool solving;
 	string input, output;
 	mutex ioMutex;
+	// Info lines of the running search, filled by the search thread.
+	// Has its own mutex, because ioMutex is held while waiting for the search to stop.
+	string searchInfo;
+	mutex infoMutex;
 	thread searchThread;
 	future<Board::SearchResults> searchResults;
+	// Mate solver for the "solve" command, searches on the same board
+	ProofNumberSearch solver;
+	future<ProofNumberSearch::Result> solveResults;
 
 public:
 	UCI();
 	void mainLoop();
 	string getWordAfter(const string& s, const string& w);
+	string getOptionName(const string& input);
+	string getInfoString(const Board::SearchResults& results);
+	string getBestMoveString(const Board::SearchResults& results);
+	string getSolveString(const ProofNumberSearch::Result& result);
 	void handleInputLoop();
 	void inputLoop();
 	void parsePosition(string input);
 	void parseGo(string input);
+	void parseSearchMoves(const string& input);
 	void parseOption(string input);
+	void parseSolve(string input);
 };
 